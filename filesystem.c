@@ -4,6 +4,15 @@
 #include<string.h> // For manipulating strings
 #include<unistd.h> // low level file and directory handling/operations
 #include<fcntl.h> // file control options
+#include<stddef.h> // offsetof
+#include<stdint.h> // fixed width integers for the name search kernels
+#include<time.h> // timing for the name search benchmark
+#include<pthread.h> // worker threads for SCRUB and the consistency check, one executor thread per shard
+#include<semaphore.h> // handing a file from one shard to another
+#include<sched.h> // sched_yield, for readers waiting out a writer
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h> // SSE2 / AVX2 intrinsics
+#endif
 
 /*
  *   ___ ___ ___ ___ ___ ___ ___ ___ ___ ___ ___ 
@@ -33,73 +42,470 @@
  *  |                                           \
  *  |     <--- super block --->                   \
  *  |______________________________________________|
- *  |               |      |      |        |       |
- *  |        free   |      |      |        |       |
- *  |       block   |inode0|inode1|   .... |inode15|
- *  |        list   |      |      |        |       |
- *  |_______________|______|______|________|_______|
+ *  |          |      |      |      |      |   |   |
+ *  |   free   |inode |      |      |      |   |   |
+ *  |  block   | used/|inode0|inode1| .... |i15|   |
+ *  |   list   | dir  |      |      |      |   |   |
+ *  |          | maps |      |      |      |   |   |
+ *  |__________|______|______|______|______|___|___|
+ *    0..127   128..191  192 + 48 * i
  */
 
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 128
+// geometry - baked into every build, so the compiler folds it into the hot paths. Other geometries are built with -DBLOCK_SIZE=.. -DNUM_BLOCKS=.. -DNUM_INODES=.., and
+// -DGEOMETRY_RUNTIME builds a generic variant whose hot paths read it from the image instead (see make geometries and make geobench)
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 1024              // a power of two
+#endif
+#ifndef NUM_BLOCKS
+#define NUM_BLOCKS 128               // a multiple of 8
+#endif
+#ifndef NUM_INODES
 #define NUM_INODES 16
+#endif
 #define FILENAME_MAXLEN 8
-int myfs;
+#define INLINE_MAX (8 * sizeof(int)) // files up to this size live inside the inode, in place of the block pointers
+#define INODE_INLINE 1               // inode flag: file data is stored inline in the inode
+#define INODE_TAIL 2                 // inode flag: the partial last block is packed into a shared fragment block
+#define INODE_HASHED 4               // inode flag: directory spans several buckets, found through an extendible hash index
+#define DIR_DEPTH_SHIFT 8            // global depth of a hashed directory's index, kept in flags bits 8..15
+#define DIR_DEPTH(node) ((node)->flags >> DIR_DEPTH_SHIFT & 0xFF)
+#define FRAG_SIZE (BLOCK_SIZE / 16)  // allocation unit inside a fragment block, 16 per block so an unsigned short masks them
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+#define FRAG_BLOCK 2                 // free block list marker for a block shared by packed file tails
+#define INODE_COMPRESSED 8           // inode flag: file contents are stored as one compressed extent
+#define INODE_ZLEN_SHIFT 16          // a compressed file keeps the stored (compressed) length in flags bits 16..31
+#define FEATURE_COMPRESS 1           // image feature: file contents are stored compressed when that saves space
+#define FEATURE_DEDUP 2              // image feature: new whole file blocks identical to a stored one share it instead
+
+#define FS_MAGIC 'H'                 // first byte of the free block list, identifies the on-disk format version
+#define CRC_BLOCK 1                  // block holding the CRC32C of every block
+#define ROOT_BLOCK 2                 // first bucket of the root directory
+#define REF_BLOCK 3                  // block holding the reference count of every block
+#define USAGE_TABLE (BLOCK_SIZE * REF_BLOCK + NUM_BLOCKS) // subtree totals of every directory, in the reference count block after the counts
+#define DEDUP_SLOTS (2 * NUM_BLOCKS) // dedup hash table slots, so the table is at most half full
+#define DEDUP_DELETED -1             // dedup table slot of a removed block, kept so probe chains stay intact
+#define DEFRAG_STEPS 8               // entries DEFRAG looks at per call unless told otherwise
+#define UNDO_RECORD (sizeof(int) + BLOCK_SIZE) // undo log record: block index, then its contents at the last snapshot
+#define INODE_MAP_BYTES ((NUM_INODES + 7) / 8)
+#define INODE_USED_MAP NUM_BLOCKS                               // hot inode flags right after the free block list: 'used' bitmap...
+#define INODE_DIR_MAP (INODE_USED_MAP + INODE_MAP_BYTES)        // ...and 'dir' bitmap, all within one cache line
+#define INODE_TABLE (NUM_BLOCKS + 64)                           // cold inode bodies start on the next cache line
+#define INODE_OFFSET(i) (INODE_TABLE + (i) * INODE_BODY_SIZE)
+#define SB_HEADER INODE_OFFSET(NUM_INODES)                      // image wide settings, in the space left after the inode table
+#define MAP_TEST(map, i) (((map)[(i) / 8] >> ((i) % 8)) & 1)
+#define INODE_PAGE 64                                           // inodes per page of in-memory inode state, a multiple of 8 so pages own whole bitmap bytes
+#define INODE_PAGES ((NUM_INODES + INODE_PAGE - 1) / INODE_PAGE)
+#define INODE_USED(i) (faultInodes(i), MAP_TEST(inodeUsedMap, i)) // inode flags, paging them in on first access
+#define INODE_DIR(i) (faultInodes(i), MAP_TEST(inodeDirMap, i))
+
+#ifndef DIRENTS_PER_BLOCK // entries per directory bucket, as many as fit a block. Building with fewer (make split) makes buckets split on a few entries
+#define DIRENTS_PER_BLOCK ((int)((BLOCK_SIZE - 2 * sizeof(int)) / (sizeof(unsigned) + FILENAME_MAXLEN + sizeof(int))))
+#endif
+#define DIR_SLOTS_PER_BLOCK (BLOCK_SIZE / sizeof(int)) // bucket pointers per directory index block
+#define DIR_MAX_DEPTH (__builtin_ctz(BLOCK_SIZE) + 1)   // 2^11 bucket pointers (for 1 KB blocks) fill all 8 block pointers of a directory with index blocks
+#ifdef GEOMETRY_RUNTIME // generic build: the allocation, directory scan and block copy paths read the geometry the image records at run time
+#define GEO_BLOCK_SIZE geo.blockSize
+#define GEO_NUM_BLOCKS geo.numBlocks
+#define GEO_NUM_INODES geo.numInodes
+#define GEO_DIRENTS geo.direntsPerBlock
+#else // specialized build: those paths use the geometry baked in, as constants
+#define GEO_BLOCK_SIZE BLOCK_SIZE
+#define GEO_NUM_BLOCKS NUM_BLOCKS
+#define GEO_NUM_INODES NUM_INODES
+#define GEO_DIRENTS DIRENTS_PER_BLOCK
+#endif
+#define GEO_FRAG_SIZE (GEO_BLOCK_SIZE / 16)
+#define GEO_DIR_SLOTS (GEO_BLOCK_SIZE / (int)sizeof(int))
+#define DIR_INDEX_BLOCKS(depth) (((1 << (depth)) + DIR_SLOTS_PER_BLOCK - 1) / DIR_SLOTS_PER_BLOCK)
+// the state of an open image is per thread, so each shard's executor thread works on its own image
+__thread int myfs;
+__thread unsigned char inodeUsedMap[INODE_MAP_BYTES], inodeDirMap[INODE_MAP_BYTES]; // in-memory copies of the hot inode bitmaps
+__thread unsigned char inodePaged[INODE_PAGES]; // pages of inode state loaded since myfs was opened or restored
+__thread unsigned blockCrc[NUM_BLOCKS];      // in-memory copy of the checksum block
+__thread unsigned char crcStale[NUM_BLOCKS]; // blocks written since their checksum was last computed
+__thread unsigned char crcVerified[NUM_BLOCKS]; // blocks checked against their checksum since myfs was opened
+__thread unsigned char blockRefs[NUM_BLOCKS]; // in-memory copy of the reference count block
+__thread int dedupTable[DEDUP_SLOTS];        // block index per slot, 0 if empty - block 0 is the superblock, never a file block
+__thread struct superheader {
+    int features;                            // FEATURE_* flags chosen when the image was created
+    int clean;                               // 1 if myfs was closed cleanly, cleared while a run has it open
+    int snapshot;                            // number of the last snapshot taken or restored
+    int defrag;                              // inode the next DEFRAG carries on from
+    unsigned char dirty[NUM_BLOCKS / 8];     // blocks changed since that snapshot
+    int freeInode;                           // no inode below this one is free, so allocation starts here
+    int geometry[3];                         // block size, blocks and inodes the image was created with
+    int defragMoved;                         // entries DEFRAG moved since its pass over the inodes started
+} sb;
+__thread struct geometry {
+    int blockSize, numBlocks, numInodes, direntsPerBlock;
+} geo;                                       // geometry of the open image, read by the hot paths of the generic build
+__thread struct usage {
+    int bytes, blocks, files;                // file bytes, whole file blocks and files in a directory's subtree
+    int parent;                              // directory holding the entry, so totals are carried up without a directory scan
+} usage[NUM_INODES];                         // in-memory copy of the usage table
+__thread int undoLog, undoRecords;           // myfs.undo, holding the contents at the last snapshot of every dirty block
+
 
 // ------------------------------ Defining Structs for Inode and Dirent ------------------------------ //
 
 /* inode */
 typedef struct inode {
-    int dir;                    // 1 if it's a directory, 0 if it's a file
     char name[FILENAME_MAXLEN]; // Name of the file or directory
     int size;                   // Size of the file or directory in bytes
-    int blockptrs[8];           // Direct pointers to data blocks
+    union {
+        int blockptrs[8];       // Direct pointers to data blocks
+        char data[INLINE_MAX];  // Inline file contents, when flags has INODE_INLINE set
+    };
+    int flags;                  // Storage flags (INODE_INLINE, INODE_TAIL, INODE_HASHED, INODE_COMPRESSED), 0 for plain block-backed entries
+    // everything above is the inode body kept in the inode table, the two flags below live in the inode bitmaps
+    int dir;                    // 1 if it's a directory, 0 if it's a file
     int used;                   // 1 if the entry is in use
-    int rsvd;                   // Reserved for future use
 } inode;
+#define INODE_BODY_SIZE offsetof(struct inode, dir)
 
-/* directory entry */
+/* directory entry - on disk, a directory block stores its entries column-wise: all name hashes, then all 8-byte names, then all inode numbers */
 typedef struct dirent {
     char name[FILENAME_MAXLEN]; // Name of the entry
     int namelen;                // Length of entry name
     int inode;                  // Index of the corresponding inode
 } dirent;
 
+/* directory block (a bucket), as stored on disk - one column per field so the names can be compared several at a time */
+typedef struct dirblock {
+    int count;                                     // number of entries in the bucket
+    int depth;                                     // local depth: number of low hash bits shared by every entry of the bucket
+    unsigned hash[DIRENTS_PER_BLOCK];              // FNV-1a hash of each name
+    char name[DIRENTS_PER_BLOCK][FILENAME_MAXLEN]; // zero padded names, one 8-byte word each
+    int inode[DIRENTS_PER_BLOCK];                  // inode number of each entry
+} dirblock;
+
+/* namespace table - every inode of an image and the directory holding it, kept in memory for readers. The writer edits its own
+ * copy and publishes it after every command; readers copy the published one under a seqlock (see Lock-free Readers). It only
+ * holds the pages of inode state paged in so far, the inodes of the other pages look unused */
+typedef struct nstable {
+    unsigned seq;                  // odd while the writer is publishing
+    int paged;                     // pages of inode state in the table, INODE_PAGES once it holds every inode
+    struct inode node[NUM_INODES]; // every inode, with its 'used' and 'dir' flags
+    int parent[NUM_INODES];        // inode of the directory holding each entry, -1 for the root
+} nstable;
+__thread nstable names;            // the writer's copy, kept up to date by writeInode and addDirEntry
+__thread nstable* published;       // the copy readers see, shared with reader threads
+__thread bool namesChanged;        // names has changes not published yet
+
+// the on-disk layout has to fit the geometry
+_Static_assert(NUM_BLOCKS % 8 == 0 && 2 * INODE_MAP_BYTES <= 64, "the inode bitmaps share one cache line after the free block list");
+_Static_assert(SB_HEADER + sizeof(struct superheader) <= BLOCK_SIZE, "the inode table and superblock header have to fit in block 0");
+_Static_assert(sizeof(struct dirblock) <= BLOCK_SIZE, "a directory bucket has to fit a block");
+_Static_assert(NUM_BLOCKS * sizeof(unsigned) <= BLOCK_SIZE, "the checksum block holds a checksum per block");
+_Static_assert(USAGE_TABLE + NUM_INODES * sizeof(struct usage) <= BLOCK_SIZE * (REF_BLOCK + 1), "the reference count block holds the usage table too");
+_Static_assert(8 * BLOCK_SIZE <= 0xFFFF, "a compressed extent's length has to fit the upper 16 flag bits");
+
+// ------------------------------ Directory Name Search Kernel ------------------------------ //
+
+/* Each kernel returns the index of the first name in names[start..count) equal to the zero padded 8-byte 'target', or -1. Names are compared as whole 64-bit words, so no kernel ever looks at individual characters */
+int scanNamesScalar(char (*names)[FILENAME_MAXLEN], int start, int count, uint64_t target){
+    for(int i = start; i < count; i++){
+        uint64_t name; memcpy(&name, names[i], sizeof(name));
+        if(name == target) return i;
+    }
+    return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) int scanNamesSSE2(char (*names)[FILENAME_MAXLEN], int start, int count, uint64_t target){
+    __m128i key = _mm_set1_epi64x((long long)target);
+    int i = start;
+    for(; i + 2 <= count; i += 2){ // 2 names per 128-bit compare, a name matches when all 8 of its byte lanes do
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)names[i]), key));
+        if((mask & 0x00FF) == 0x00FF) return i;
+        if((mask & 0xFF00) == 0xFF00) return i + 1;
+    }
+    return scanNamesScalar(names, i, count, target);
+}
+
+__attribute__((target("avx2"))) int scanNamesAVX2(char (*names)[FILENAME_MAXLEN], int start, int count, uint64_t target){
+    __m256i key = _mm256_set1_epi64x((long long)target);
+    int i = start;
+    for(; i + 4 <= count; i += 4){ // 4 names per 256-bit compare, one 64-bit lane each
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i*)names[i]), key)));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return scanNamesScalar(names, i, count, target);
+}
+#endif
+
+int (*scanNames)(char (*names)[FILENAME_MAXLEN], int start, int count, uint64_t target) = scanNamesScalar;
+
+void selectNameScan(){
+    /*Picks the widest name search kernel the CPU supports, falling back to the scalar one */
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) scanNames = scanNamesAVX2;
+    else if(__builtin_cpu_supports("sse2")) scanNames = scanNamesSSE2;
+#endif
+}
+
+void copyName(char* dst, char* src){
+    /*Copies a name into a FILENAME_MAXLEN field, zero padded - an 8 character name fills the field without a terminator */
+    memset(dst, 0, FILENAME_MAXLEN);
+    memcpy(dst, src, strnlen(src, FILENAME_MAXLEN));
+}
+
+uint64_t nameKey(char* name){
+    /*Packs a name into the zero padded 64-bit word it is stored as in a directory block */
+    char padded[FILENAME_MAXLEN]; uint64_t key;
+    copyName(padded, name); memcpy(&key, padded, sizeof(key));
+    return key;
+}
+
+// ------------------------------ Block I/O and Checksums ------------------------------ //
+/* Every block has a CRC32C in the checksum block (block 1). All reads and writes of myfs go through fsRead/fsWrite: the first
+ * access to a block since opening verifies it, a write marks its checksum stale, and syncChecksums recomputes the stale ones
+ * when myfs is closed (or scrubbed) - so a block written many times during a run is only checksummed once. The checksum of the checksum
+ * block itself is taken with its own slot zeroed, and stored in that slot. */
+
+unsigned crcTable[256]; // table for the byte at a time CRC32C fallback
+
+unsigned crc32cTable(const void* buf, size_t len){
+    const unsigned char* p = buf; unsigned crc = ~0u;
+    while(len--) crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) unsigned crc32cSSE42(const void* buf, size_t len){ // 8 bytes per crc32 instruction
+    const unsigned char* p = buf; uint64_t crc = ~0u, word;
+    for(; len >= 8; len -= 8, p += 8){
+        memcpy(&word, p, sizeof(word)); crc = _mm_crc32_u64(crc, word);
+    }
+    while(len--) crc = _mm_crc32_u8((unsigned)crc, *p++);
+    return ~(unsigned)crc;
+}
+#endif
+
+unsigned (*crc32c)(const void* buf, size_t len) = crc32cTable;
+
+void selectChecksum(){
+    /*Builds the CRC32C table, and switches to the SSE4.2 crc32 instruction if the CPU has it */
+    for(unsigned i = 0; i < 256; i++){
+        unsigned crc = i;
+        for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78u & -(crc & 1));
+        crcTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) crc32c = crc32cSSE42;
+#endif
+}
+
+unsigned checksumBlock(int block, const char* data){
+    /*Checksum of a block's contents. The checksum block is summed with its own slot zeroed */
+    if(block != CRC_BLOCK) return crc32c(data, BLOCK_SIZE);
+    char copy[BLOCK_SIZE]; memcpy(copy, data, BLOCK_SIZE); memset(copy + CRC_BLOCK * sizeof(unsigned), 0, sizeof(unsigned));
+    return crc32c(copy, BLOCK_SIZE);
+}
+
+void verifyBlock(int block){
+    /*Checks a block against its stored checksum, reporting a mismatch */
+    char data[BLOCK_SIZE];
+    pread(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * block);
+    if(!crcStale[block] && checksumBlock(block, data) != blockCrc[block]) printf("Error: Checksum mismatch in block %d, its contents may be corrupted\n", block);
+    crcVerified[block] = 1;
+}
+
+void fsRead(off_t offset, void* buf, size_t len){
+    /*Reads 'len' bytes at 'offset' from myfs, verifying each block touched the first time it is read. Reads use pread, so threads can share myfs */
+    for(int b = offset / GEO_BLOCK_SIZE; b <= (offset + len - 1) / GEO_BLOCK_SIZE; b++) if(!crcVerified[b]) verifyBlock(b);
+    pread(myfs, buf, len, offset);
+}
+
+void markDirty(int block){
+    /*Records that a block changed since the last snapshot. Its contents from before the change are appended to the undo log first, so the next snapshot can carry them and ROLLBACK can put them back */
+    char old[BLOCK_SIZE];
+    pread(myfs, old, BLOCK_SIZE, (off_t)BLOCK_SIZE * block);
+    pwrite(undoLog, &block, sizeof(int), (off_t)undoRecords * UNDO_RECORD);
+    pwrite(undoLog, old, BLOCK_SIZE, (off_t)undoRecords * UNDO_RECORD + sizeof(int));
+    undoRecords++; sb.dirty[block / 8] |= 1 << (block % 8);
+}
+
+void fsWrite(off_t offset, const void* buf, size_t len){
+    /*Writes 'len' bytes at 'offset' into myfs. A write covering a whole block is checksummed straight from the buffer; a partial one verifies the block first (so corruption is not blessed by the new checksum) and leaves the checksum to syncChecksums. The first write to a block since the last snapshot marks it dirty */
+    for(int b = offset / GEO_BLOCK_SIZE; b <= (offset + len - 1) / GEO_BLOCK_SIZE; b++) if(!MAP_TEST(sb.dirty, b)) markDirty(b);
+    if(len == GEO_BLOCK_SIZE && offset % GEO_BLOCK_SIZE == 0){
+        int b = offset / GEO_BLOCK_SIZE;
+        blockCrc[b] = checksumBlock(b, buf); crcVerified[b] = 1; crcStale[b] = 0; crcStale[CRC_BLOCK] = 1;
+    }
+    else for(int b = offset / GEO_BLOCK_SIZE; b <= (offset + len - 1) / GEO_BLOCK_SIZE; b++){
+        if(!crcVerified[b]) verifyBlock(b);
+        crcStale[b] = 1; crcStale[CRC_BLOCK] = 1;
+    }
+    lseek(myfs, offset, SEEK_SET); write(myfs, buf, len);
+}
+
+void writeHeader(){
+    /*Writes the superblock header. It describes myfs rather than being part of its contents, so writing it never marks block 0 dirty */
+    if(!crcVerified[0]) verifyBlock(0);
+    crcStale[0] = 1; crcStale[CRC_BLOCK] = 1;
+    pwrite(myfs, &sb, sizeof(sb), SB_HEADER);
+}
+
+void syncChecksums(){
+    /*Recomputes the checksums of the blocks written since the last sync, then writes the checksum block back */
+    if(!crcStale[CRC_BLOCK]) return; // nothing was written
+    char data[BLOCK_SIZE];
+    for(int b = 0; b < NUM_BLOCKS; b++){
+        if(!crcStale[b] || b == CRC_BLOCK) continue;
+        pread(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * b);
+        blockCrc[b] = crc32c(data, BLOCK_SIZE); crcStale[b] = 0;
+    }
+    memset(data, 0, BLOCK_SIZE); blockCrc[CRC_BLOCK] = 0; memcpy(data, blockCrc, sizeof(blockCrc));
+    blockCrc[CRC_BLOCK] = checksumBlock(CRC_BLOCK, data); memcpy(data, blockCrc, sizeof(blockCrc));
+    pwrite(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * CRC_BLOCK);
+    crcStale[CRC_BLOCK] = 0;
+}
+
+typedef struct imageview { // the per-thread image state a helper thread needs to read the image of the thread that started it
+    int myfs;
+    unsigned char inodeUsedMap[INODE_MAP_BYTES], inodeDirMap[INODE_MAP_BYTES];
+    unsigned blockCrc[NUM_BLOCKS];
+    unsigned char crcStale[NUM_BLOCKS], crcVerified[NUM_BLOCKS];
+} imageview;
+
+void shareImage(imageview* view){
+    /*Captures the calling thread's image state, for helper threads to adopt */
+    view->myfs = myfs;
+    memcpy(view->inodeUsedMap, inodeUsedMap, INODE_MAP_BYTES); memcpy(view->inodeDirMap, inodeDirMap, INODE_MAP_BYTES);
+    memcpy(view->blockCrc, blockCrc, sizeof(blockCrc)); memcpy(view->crcStale, crcStale, NUM_BLOCKS); memcpy(view->crcVerified, crcVerified, NUM_BLOCKS);
+}
+
+void adoptImage(const imageview* view){
+    /*Takes on image state captured by shareImage, so a helper thread reads the same image. Whatever the helper changes stays its own */
+    myfs = view->myfs;
+    memcpy(inodeUsedMap, view->inodeUsedMap, INODE_MAP_BYTES); memcpy(inodeDirMap, view->inodeDirMap, INODE_MAP_BYTES);
+    memcpy(blockCrc, view->blockCrc, sizeof(blockCrc)); memcpy(crcStale, view->crcStale, NUM_BLOCKS); memcpy(crcVerified, view->crcVerified, NUM_BLOCKS);
+}
+
+void distrustChecksums(const unsigned char* blocks){
+    /*Marks the checksums of the blocks in the 'blocks' bitmap out of date (every block if it is NULL), for blocks rewritten behind their checksums: they are recomputed by the next syncChecksums instead of checked. The superblock (whose header is written without marking it dirty) and the checksum block itself always are. Every other block keeps being checked */
+    for(int b = 0; b < NUM_BLOCKS; b++){
+        if(blocks != NULL && !MAP_TEST(blocks, b) && b != 0 && b != CRC_BLOCK) continue;
+        crcStale[b] = 1; crcVerified[b] = 1;
+    }
+}
+
+void loadChecksums(){
+    /*Loads the checksum block into memory, verifying it against its own checksum */
+    char data[BLOCK_SIZE];
+    pread(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * CRC_BLOCK);
+    memcpy(blockCrc, data, sizeof(blockCrc));
+    if(checksumBlock(CRC_BLOCK, data) != blockCrc[CRC_BLOCK]) printf("Error: Checksum mismatch in the checksum block, block checksums cannot be trusted\n");
+    crcVerified[CRC_BLOCK] = 1;
+}
+
+bool loadGeometry(){
+    /*Takes the geometry of the open image from its superblock header for the hot paths of the generic build, returning false if it is not the geometry this build lays images out for - the in-memory tables of every build are sized for one geometry */
+    geo.blockSize = sb.geometry[0]; geo.numBlocks = sb.geometry[1]; geo.numInodes = sb.geometry[2];
+    geo.direntsPerBlock = (geo.blockSize - 2 * (int)sizeof(int)) / (int)(sizeof(unsigned) + FILENAME_MAXLEN + sizeof(int));
+    if(geo.direntsPerBlock > DIRENTS_PER_BLOCK) geo.direntsPerBlock = DIRENTS_PER_BLOCK; // no more than a bucket of this build holds (see make split)
+    return geo.blockSize == BLOCK_SIZE && geo.numBlocks == NUM_BLOCKS && geo.numInodes == NUM_INODES;
+}
+
+// ------------------------------ Inode and Directory Entry Access ------------------------------ //
+
+void faultInodes(int i){
+    /*Loads the page of in-memory inode state holding inode i on its first access: its bytes of the hot 'used' and 'dir' bitmaps, its usage
+     * entries and its namespace entries. Opening myfs loads none of it, so startup costs the same whatever the number of inodes */
+    int page = i / INODE_PAGE, first = page * INODE_PAGE, count = (first + INODE_PAGE > NUM_INODES) ? NUM_INODES - first : INODE_PAGE;
+    if(inodePaged[page]) return;
+    inodePaged[page] = 1; names.paged++;
+    fsRead(INODE_USED_MAP + first / 8, &inodeUsedMap[first / 8], (count + 7) / 8);
+    fsRead(INODE_DIR_MAP + first / 8, &inodeDirMap[first / 8], (count + 7) / 8);
+    fsRead(USAGE_TABLE + first * sizeof(struct usage), &usage[first], count * sizeof(struct usage));
+    for(int n = first; n < first + count; n++){
+        memset(&names.node[n], 0, sizeof(names.node[n])); names.parent[n] = (n == 0) ? -1 : usage[n].parent;
+        if(!MAP_TEST(inodeUsedMap, n)) continue;
+        fsRead(INODE_OFFSET(n), &names.node[n], INODE_BODY_SIZE);
+        names.node[n].used = 1; names.node[n].dir = MAP_TEST(inodeDirMap, n);
+    }
+    namesChanged = true;
+}
+
+void pageAllInodes(){
+    /*Faults in every page of inode state, for work over the whole table: listings and fsck */
+    for(int p = 0; p < INODE_PAGES; p++) faultInodes(p * INODE_PAGE);
+}
+
+void readInode(int i, struct inode* node){
+    /*Reads the body of inode i from the inode table, and fills in its 'used' and 'dir' flags from the inode bitmaps */
+    fsRead(INODE_OFFSET(i), (char*)node, INODE_BODY_SIZE);
+    node->used = INODE_USED(i); node->dir = INODE_DIR(i);
+}
+
+void writeInode(int i, struct inode* node){
+    /*Writes the body of inode i into the inode table, and its 'used' and 'dir' flags into the inode bitmaps (in memory and in myfs) */
+    faultInodes(i); // the bitmap bytes below are updated in place
+    fsWrite(INODE_OFFSET(i), (char*)node, INODE_BODY_SIZE);
+    if(!node->used && i < sb.freeInode) sb.freeInode = i;
+    unsigned char bit = 1 << (i % 8);
+    inodeUsedMap[i / 8] = node->used ? (inodeUsedMap[i / 8] | bit) : (inodeUsedMap[i / 8] & ~bit);
+    inodeDirMap[i / 8] = node->dir ? (inodeDirMap[i / 8] | bit) : (inodeDirMap[i / 8] & ~bit);
+    fsWrite(INODE_USED_MAP + i / 8, &inodeUsedMap[i / 8], 1);
+    fsWrite(INODE_DIR_MAP + i / 8, &inodeDirMap[i / 8], 1);
+    names.node[i] = *node; namesChanged = true; // readers see it once the command is over
+}
+
+unsigned nameHash(char* name){
+    /*FNV-1a hash of an entry name, stored next to the name in the directory block. Its low bits pick the bucket of a hashed directory */
+    unsigned hash = 2166136261u;
+    for(int i = 0; i < FILENAME_MAXLEN && name[i] != '\0'; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
 // ------------------------------ Initializing File System - MYFS ------------------------------ //
 
-int init(){
-    int myfs = open("./myfs", O_CREAT | O_RDWR, 0666); // create a file named myfs with read write enabled
+int init(char* image, int features){
+    myfs = open(image, O_CREAT | O_RDWR, 0666); // create the image file (./myfs unless sharded) with read write enabled
     if(myfs == -1){
         printf("Error: Cannot create file system myfs\n"); return -1;
     }
+    ftruncate(undoLog, 0); undoRecords = 0; // an undo log left behind by an older myfs is of no use
+
+    ftruncate(myfs, BLOCK_SIZE * NUM_BLOCKS); // 128 * 1024 = 128KB allocated to myfs, for the standard geometry
+    sb.geometry[0] = BLOCK_SIZE; sb.geometry[1] = NUM_BLOCKS; sb.geometry[2] = NUM_INODES; loadGeometry(); // before the first write, which the generic build splits into blocks by it
 
-    ftruncate(myfs, BLOCK_SIZE * NUM_BLOCKS); // 128 * 1024 = 128KB allocated to myfs
+    // every block starts out zeroed, so they all share the checksum of an empty block
+    char empty[BLOCK_SIZE] = {0}; unsigned crc = crc32c(empty, BLOCK_SIZE);
+    for(int b = 0; b < NUM_BLOCKS; b++){
+        blockCrc[b] = crc; crcVerified[b] = 1;
+    }
 
-    char fs = 'A'; write(myfs, (char*)&fs, 1);
-    char dbm = (char)1; write(myfs, (char*)&dbm, 1);
-    // writes 'A' and 1 to the first two bytes of myfs - identification and directory bitmap, 'A' for ident, 1 shows it is a directory
+    char fs = FS_MAGIC; fsWrite(0, &fs, 1);
+    sb.features = features; sb.clean = 1; // image wide settings, fixed from here on
+    writeHeader();
+    char dbm[3] = {1, 1, 1}; fsWrite(CRC_BLOCK, dbm, 3);
+    // writes the format magic and 1 to the next three bytes of myfs - identification, then the checksum block, the root directory's block and the reference count block marked occupied
 
     // Initializing the Root Inode
     struct inode root_inode;
     root_inode.dir = 1; // root inode is a directory
     strcpy(root_inode.name, "/"); // first root directory named "/"
     root_inode.size = sizeof(struct dirent);
-    root_inode.blockptrs[0] = 1;
+    root_inode.blockptrs[0] = ROOT_BLOCK;
     root_inode.used = 1; // yes it is in use
-    root_inode.rsvd = 0; // no it is not reserved for future use
+    root_inode.flags = 0; // plain block-backed entry
     
     // write the root inode into myfs
-    lseek(myfs, NUM_BLOCKS, SEEK_SET); write(myfs, (char*)&root_inode, sizeof(struct inode));
+    writeInode(0, &root_inode);
 
-    // Initializing the Root Directory Entry
-    struct dirent root_dirent;
-    strcpy(root_dirent.name, ".");
-    root_dirent.namelen = 1;
-    root_dirent.inode = 0;
+    // Initializing the Root Directory Entry, the only entry of the root directory's single bucket
+    struct dirblock root_block = {0};
+    root_block.count = 1; root_block.hash[0] = nameHash("."); strcpy(root_block.name[0], "."); root_block.inode[0] = 0;
 
-    // write the root directory entry into myfs
-    lseek(myfs, BLOCK_SIZE, SEEK_SET); write(myfs, (char*)&root_dirent, sizeof(struct dirent));
+    // write the root directory block into myfs
+    fsWrite(BLOCK_SIZE * ROOT_BLOCK, &root_block, sizeof(root_block));
 
+    syncChecksums();
+    memset(sb.dirty, 0, sizeof(sb.dirty)); ftruncate(undoLog, 0); undoRecords = 0; // the empty file system is snapshot 0
     return myfs;
 }
 
@@ -111,6 +517,16 @@ int init(){
 // 5. create directory
 // 6. remove a directory
 // 7. list file info
+// 8. verify every block checksum
+// 9. deduplicate the blocks of existing files
+// 10. check myfs against its directory tree and repair it
+// 11. snapshot the blocks changed since the last snapshot into a delta file
+// 12. list the blocks changed since the last snapshot
+// 13. apply a delta file
+// 14. roll a delta file back
+// 15. move files and directories into place, a few at a time
+// 16. show the type and size of one entry
+// 17. show the bytes, blocks and files below a directory
 int CR(char* filename, int size);
 int DL(char* filename);
 int CP(char* srcname, char* dstname);
@@ -118,19 +534,446 @@ int MV(char* srcname, char* dstname);
 int CD(char* dirname);
 int DD(char* dirname);
 void LL();
+void SCRUB();
+void DEDUP();
+void FSCK();
+void SNAPSHOT(char* deltaname);
+void DIFF();
+void APPLY(char* deltaname);
+void ROLLBACK(char* deltaname);
+void DEFRAG(int steps, bool report);
+void STAT(char* path);
+void DU(char* path);
 
 // ------------------------------ Helpers Along the Way ------------------------------ //
 int findAvailableInode(){
-    /*Finds and returns the first available inode in myfs. It reads the inode data, iterates over it, and returns the index of the first unused inode. If no available inodes are found, it shown an error message and returns -1*/
-    struct inode inodes[NUM_INODES];
-    lseek(myfs, NUM_BLOCKS, SEEK_SET); read(myfs, (char*)inodes, NUM_INODES * sizeof(struct inode));
-    for(int i = 0; i < NUM_INODES; i++){
-        if(inodes[i].used == 0) return i;
+    /*Finds and returns the first available inode in myfs. It scans the in-memory 'used' bitmap from the free inode hint, skipping full bytes, and returns the index of the first unused inode. If no available inodes are found, it shown an error message and returns -1*/
+    for(int i = sb.freeInode & ~7; i < GEO_NUM_INODES; i++){
+        faultInodes(i);
+        if(inodeUsedMap[i / 8] == 0xFF){ i += 7; continue; } // all 8 inodes of this byte are in use
+        if(!MAP_TEST(inodeUsedMap, i)){ sb.freeInode = i; return i; }
     }
     printf("Error: No available inodes\n");
     return -1;
 }
 
+int storedSize(struct inode* node){
+    /*Returns the number of bytes a file keeps on disk: its size, or the length of its compressed extent */
+    if(node->flags & INODE_COMPRESSED) return (unsigned)node->flags >> INODE_ZLEN_SHIFT;
+    return node->size;
+}
+
+int fileBlockCount(struct inode* node){
+    /*Returns the number of whole data blocks a file occupies. Inline files keep their contents inside the inode and own no data blocks; packed files keep their partial last block in a fragment, referenced by the pointer right after the whole blocks */
+    if(node->flags & INODE_INLINE) return 0;
+    if(node->flags & INODE_TAIL) return storedSize(node) / GEO_BLOCK_SIZE;
+    return (storedSize(node) % GEO_BLOCK_SIZE != 0) + (storedSize(node) / GEO_BLOCK_SIZE);
+}
+
+int tailFragments(int size){
+    /*Returns the number of FRAG_SIZE slots needed to pack the partial last block of a file of the given size, or 0 if the tail should not be packed - either there is no tail, or it is too large to share a fragment block (slot 0 of every fragment block holds its header) */
+    int frags = (size % GEO_BLOCK_SIZE + GEO_FRAG_SIZE - 1) / GEO_FRAG_SIZE;
+    return (frags < FRAGS_PER_BLOCK) ? frags : 0;
+}
+
+int findAvailableDataBlock(int* blockpointers, int blockcount){
+    /*Finds the available data blocks by reading the block occupancy status, and iterating through the data blocks, assigning the indices to the blockpointers. If no available data blocks then an error is shown */
+    int dbi = 1; //Initialize data block index to 1
+    char occupado[NUM_BLOCKS]; //array to store block occupancy status
+    fsRead(0, occupado, GEO_NUM_BLOCKS);
+
+    for(int i = 0; i < blockcount; i++){
+        bool flag = false; //flag to indicate if aviailable block found
+        while(dbi < GEO_NUM_BLOCKS){
+            if(occupado[dbi] == (char)0){ // If block not occupied, assign index of available block to blockpointers, increment index, set flag to true, break inner loop and move onto next index
+                blockpointers[i] = dbi; dbi++;
+                flag = true; break;
+            }
+            dbi++;
+        }
+        if(flag == false){ //if no data blocks found, print error.
+            printf("Error: No available data blocks\n"); return -1;
+        }
+    }
+    return 0;
+}
+
+int findAvailableFragment(int frags){
+    /*Looks for 'frags' contiguous free slots in an existing fragment block. A fragment block starts with an unsigned short occupancy mask, one bit per FRAG_SIZE slot, with slot 0 (the header) always set. Returns the byte address of the first free slot of the run, or -1 if no fragment block has room and a fresh one is needed. Nothing is claimed here - see claimFragment */
+    char occupado[NUM_BLOCKS]; unsigned short mask;
+    fsRead(0, occupado, GEO_NUM_BLOCKS);
+    for(int b = 1; b < GEO_NUM_BLOCKS; b++){
+        if(occupado[b] != (char)FRAG_BLOCK) continue;
+        fsRead((off_t)GEO_BLOCK_SIZE * b, &mask, sizeof(mask));
+        for(int slot = 1, run = 0; slot < FRAGS_PER_BLOCK; slot++){ // count the free slots in a row, restarting at every used one
+            run = (mask & (1 << slot)) ? 0 : run + 1;
+            if(run == frags) return GEO_BLOCK_SIZE * b + GEO_FRAG_SIZE * (slot - frags + 1);
+        }
+    }
+    return -1;
+}
+
+void claimFragment(int addr, int frags){
+    /*Marks 'frags' slots starting at byte address 'addr' as used. If the block is not yet a fragment block (a freshly allocated data block), it is turned into one with an empty header first */
+    int block = addr / GEO_BLOCK_SIZE, slot = (addr % GEO_BLOCK_SIZE) / GEO_FRAG_SIZE;
+    char state; unsigned short mask = 1; // only the header slot in use
+    fsRead(block, &state, 1);
+    if(state == (char)FRAG_BLOCK){
+        fsRead(GEO_BLOCK_SIZE * block, &mask, sizeof(mask));
+    }
+    else{
+        state = (char)FRAG_BLOCK; fsWrite(block, &state, 1);
+    }
+    for(int i = 0; i < frags; i++) mask |= 1 << (slot + i);
+    fsWrite(GEO_BLOCK_SIZE * block, &mask, sizeof(mask));
+}
+
+void releaseFragment(int addr, int frags){
+    /*Clears the tail stored at byte address 'addr' and frees its 'frags' slots. When the last tail leaves a fragment block, the whole block goes back to the free block list */
+    int block = addr / GEO_BLOCK_SIZE, slot = (addr % GEO_BLOCK_SIZE) / GEO_FRAG_SIZE;
+    char blockData[BLOCK_SIZE] = {0}; unsigned short mask;
+    fsRead(GEO_BLOCK_SIZE * block, &mask, sizeof(mask));
+    for(int i = 0; i < frags; i++) mask &= ~(1 << (slot + i));
+    if(mask == 1){ // only the header is left, so the block is no longer needed
+        char nc = '\0';
+        fsWrite(block, &nc, 1);
+        fsWrite(GEO_BLOCK_SIZE * block, blockData, GEO_BLOCK_SIZE);
+    }
+    else{
+        fsWrite(addr, blockData, frags * GEO_FRAG_SIZE);
+        fsWrite(GEO_BLOCK_SIZE * block, &mask, sizeof(mask));
+    }
+}
+
+int allocateBlock(){
+    /*Finds a free data block and marks it occupied straight away, for blocks needed in the middle of an operation. Returns the block index or -1 */
+    int block; char c = (char)1;
+    if(findAvailableDataBlock(&block, 1) == -1) return -1;
+    fsWrite(block, &c, 1);
+    return block;
+}
+
+void freeBlock(int block){
+    /*Clears a data block and returns it to the free block list */
+    char nc = '\0', blockData[BLOCK_SIZE] = {0};
+    fsWrite(block, &nc, 1);
+    fsWrite(GEO_BLOCK_SIZE * block, blockData, GEO_BLOCK_SIZE);
+}
+
+int allocateFragment(int frags){
+    /*Claims 'frags' contiguous slots in a fragment block, starting a fresh fragment block if none has room. Returns the byte address of the slots or -1 */
+    int addr = findAvailableFragment(frags);
+    if(addr == -1){
+        int block = allocateBlock();
+        if(block == -1) return -1;
+        addr = GEO_BLOCK_SIZE * block + GEO_FRAG_SIZE; // first slot after the header of the fresh block
+    }
+    claimFragment(addr, frags);
+    return addr;
+}
+
+// ------------------------------ Block Deduplication ------------------------------ //
+/* Whole file blocks are content addressed by their CRC32C, which the checksum block already keeps for every block. dedupTable maps
+ * checksums to the file blocks holding them, and the reference count block records how many file pointers share each block - 0 for
+ * blocks that are not indexed (directory buckets, fragment blocks, partial last blocks). On images created with -d, writeFileData points
+ * a file at an identical indexed block instead of writing a new one; DEDUP indexes and merges the blocks of an existing image. The
+ * table is rebuilt from the reference counts and checksums whenever myfs is opened. */
+
+void setBlockRefs(int block, int refs){
+    /*Sets the reference count of a block, in memory and in the reference count block */
+    blockRefs[block] = refs; fsWrite(BLOCK_SIZE * REF_BLOCK + block, &blockRefs[block], 1);
+}
+
+void dedupInsert(int block){
+    /*Indexes a file block under its checksum, which has to be up to date (true right after a whole block write) */
+    unsigned h = blockCrc[block] % DEDUP_SLOTS;
+    while(dedupTable[h] > 0) h = (h + 1) % DEDUP_SLOTS; // linear probing, reusing the first empty or deleted slot
+    dedupTable[h] = block;
+}
+
+void dedupRemove(int block){
+    /*Drops a file block from the dedup table, before its contents (and so its checksum) change */
+    unsigned h = blockCrc[block] % DEDUP_SLOTS;
+    for(int n = 0; n < DEDUP_SLOTS && dedupTable[h] != 0; n++, h = (h + 1) % DEDUP_SLOTS){
+        if(dedupTable[h] == block){ dedupTable[h] = DEDUP_DELETED; return; }
+    }
+}
+
+int dedupLookup(const char* data){
+    /*Returns an indexed block holding exactly the BLOCK_SIZE bytes at 'data', or -1. Blocks with a matching checksum are compared byte for byte, so a checksum collision never merges different contents */
+    unsigned crc = crc32c(data, BLOCK_SIZE), h = crc % DEDUP_SLOTS; char stored[BLOCK_SIZE];
+    for(int n = 0; n < DEDUP_SLOTS && dedupTable[h] != 0; n++, h = (h + 1) % DEDUP_SLOTS){
+        int block = dedupTable[h];
+        if(block == DEDUP_DELETED || blockCrc[block] != crc || crcStale[block]) continue;
+        fsRead(BLOCK_SIZE * block, stored, BLOCK_SIZE);
+        if(memcmp(stored, data, BLOCK_SIZE) == 0) return block;
+    }
+    return -1;
+}
+
+int releaseBlockRef(int block){
+    /*Drops one reference to a file block. Returns 1 if other files still share the block, so it must be left alone, or 0 if the caller should free it */
+    if(blockRefs[block] > 1){
+        setBlockRefs(block, blockRefs[block] - 1); return 1;
+    }
+    if(blockRefs[block] == 1){ // last user, the block leaves the index
+        dedupRemove(block); setBlockRefs(block, 0);
+    }
+    return 0;
+}
+
+void loadBlockRefs(){
+    /*Loads the reference count block into memory and rebuilds the dedup table from it */
+    fsRead(BLOCK_SIZE * REF_BLOCK, blockRefs, NUM_BLOCKS);
+    for(int b = 0; b < NUM_BLOCKS; b++) if(blockRefs[b] > 0) dedupInsert(b);
+}
+
+// ------------------------------ Compression and File Data ------------------------------ //
+/* On images created with compression (myfs.out -c), a file's contents are run through compressData on their way to disk and, if
+ * that makes them smaller, stored as one compressed extent: laid out exactly like plain contents (inline, whole blocks and a packed
+ * tail), with INODE_COMPRESSED set and the extent's length in the upper flag bits. The codec packs the file's alphabet: contents
+ * using k distinct byte values store each byte as a ceil(log2 k) bit code, which turns the random lowercase letters CR writes into
+ * 5 bits per byte. */
+
+int compressData(const unsigned char* in, int size, unsigned char* out){
+    /*Compresses 'size' bytes into 'out' as: alphabet size - 1, the alphabet, then the packed codes. Returns the compressed length, or -1 if that is not smaller than the input */
+    unsigned char present[256] = {0}, code[256]; int k = 0, bits = 1;
+    for(int i = 0; i < size; i++) present[in[i]] = 1;
+    for(int v = 0; v < 256; v++) if(present[v]){ code[v] = k; out[1 + k++] = v; }
+    while((1 << bits) < k) bits++;
+    int len = 1 + k + (size * bits + 7) / 8;
+    if(len >= size) return -1;
+
+    out[0] = k - 1;
+    unsigned acc = 0; int held = 0; unsigned char* p = out + 1 + k;
+    for(int i = 0; i < size; i++){ // codes are packed least significant bit first
+        acc |= code[in[i]] << held; held += bits;
+        while(held >= 8){ *p++ = acc & 0xFF; acc >>= 8; held -= 8; }
+    }
+    if(held > 0) *p = acc & 0xFF;
+    return len;
+}
+
+void decompressData(const unsigned char* in, unsigned char* out, int size){
+    /*Expands data written by compressData back into its original 'size' bytes */
+    int k = in[0] + 1, bits = 1;
+    while((1 << bits) < k) bits++;
+    const unsigned char* alphabet = in + 1, *p = in + 1 + k;
+    unsigned acc = 0; int held = 0;
+    for(int i = 0; i < size; i++){
+        while(held < bits){ acc |= *p++ << held; held += 8; }
+        out[i] = alphabet[acc & ((1u << bits) - 1)]; acc >>= bits; held -= bits;
+    }
+}
+
+void freeFileData(struct inode* node){
+    /*Releases everything a file stores outside its inode: whole blocks are cleared and returned to the free block list unless another file still shares them, the packed tail gives back its fragment slots */
+    char nc = '\0', blockData[BLOCK_SIZE] = {0};
+    int size = storedSize(node), blockcount = fileBlockCount(node); // inline files own no blocks, so nothing past the inode is touched
+    for(int i = 0; i < blockcount; i++, size -= BLOCK_SIZE){
+        if(releaseBlockRef(node->blockptrs[i])) continue; // still referenced by another file
+        fsWrite(node->blockptrs[i], &nc, 1);
+        fsWrite(BLOCK_SIZE * node->blockptrs[i], blockData, (size > BLOCK_SIZE) ? BLOCK_SIZE : size);
+    }
+    if(node->flags & INODE_TAIL) releaseFragment(node->blockptrs[blockcount], tailFragments(storedSize(node))); // the packed tail only frees its own slots
+}
+
+int writeFileData(struct inode* node, char* data, int size){
+    /*Stores 'size' bytes of file contents - compressed first where the image allows it and it pays off - and fills in the size, flags and block pointers of 'node': inline if the stored bytes fit in the inode, otherwise in whole blocks with the partial last block packed into a fragment. On images with inline deduplication a whole block already stored by another file is shared instead of written. Space is claimed as it is written; on failure whatever was claimed is released again and -1 is returned */
+    unsigned char packed[8 * BLOCK_SIZE]; int zlen = -1;
+    node->size = size; node->flags = 0;
+    if((sb.features & FEATURE_COMPRESS) && size > INLINE_MAX && (zlen = compressData((unsigned char*)data, size, packed)) != -1){
+        node->flags = INODE_COMPRESSED | zlen << INODE_ZLEN_SHIFT; data = (char*)packed; size = zlen;
+    }
+    if(size <= INLINE_MAX){ // tiny files are stored inline in the inode, so no data blocks are needed
+        memcpy(node->data, data, size); node->flags |= INODE_INLINE; return 0;
+    }
+    int frags = tailFragments(size), blockcount = size / GEO_BLOCK_SIZE + (size % GEO_BLOCK_SIZE != 0 && frags == 0);
+    for(int i = 0; i < blockcount; i++){
+        int shared = (sb.features & FEATURE_DEDUP) && size - i * GEO_BLOCK_SIZE >= GEO_BLOCK_SIZE; // only whole blocks are indexed
+        int block = shared ? dedupLookup(data + i * GEO_BLOCK_SIZE) : -1;
+        if(block != -1){ // an identical block is already stored, so it just gains a reference
+            setBlockRefs(block, blockRefs[block] + 1); node->blockptrs[i] = block; continue;
+        }
+        block = allocateBlock();
+        if(block == -1){
+            if(node->flags & INODE_COMPRESSED) node->flags = INODE_COMPRESSED | (i * GEO_BLOCK_SIZE) << INODE_ZLEN_SHIFT;
+            else node->size = i * GEO_BLOCK_SIZE;
+            freeFileData(node); return -1; // give back the blocks written so far
+        }
+        node->blockptrs[i] = block;
+        fsWrite(GEO_BLOCK_SIZE * block, data + i * GEO_BLOCK_SIZE, (size - i * GEO_BLOCK_SIZE < GEO_BLOCK_SIZE) ? size - i * GEO_BLOCK_SIZE : GEO_BLOCK_SIZE);
+        if(shared){ setBlockRefs(block, 1); dedupInsert(block); }
+    }
+    if(frags > 0){ // the pointer after the whole blocks holds the byte address of the packed tail
+        int addr = allocateFragment(frags);
+        if(addr == -1){
+            if(node->flags & INODE_COMPRESSED) node->flags = INODE_COMPRESSED | (blockcount * GEO_BLOCK_SIZE) << INODE_ZLEN_SHIFT;
+            else node->size = blockcount * GEO_BLOCK_SIZE;
+            freeFileData(node); return -1;
+        }
+        fsWrite(addr, data + blockcount * GEO_BLOCK_SIZE, size % GEO_BLOCK_SIZE);
+        node->flags |= INODE_TAIL; node->blockptrs[blockcount] = addr;
+    }
+    return 0;
+}
+
+void readFileData(struct inode* node, char* data){
+    /*Reads the whole contents of a file into 'data', expanding a compressed extent */
+    unsigned char packed[8 * BLOCK_SIZE]; char* stored = (node->flags & INODE_COMPRESSED) ? (char*)packed : data;
+    int size = storedSize(node), blockcount = fileBlockCount(node);
+    if(node->flags & INODE_INLINE) memcpy(stored, node->data, size);
+    for(int i = 0; i < blockcount; i++) fsRead(GEO_BLOCK_SIZE * node->blockptrs[i], stored + i * GEO_BLOCK_SIZE, (size - i * GEO_BLOCK_SIZE < GEO_BLOCK_SIZE) ? size - i * GEO_BLOCK_SIZE : GEO_BLOCK_SIZE);
+    if(node->flags & INODE_TAIL) fsRead(node->blockptrs[blockcount], stored + blockcount * GEO_BLOCK_SIZE, size % GEO_BLOCK_SIZE);
+    if(node->flags & INODE_COMPRESSED) decompressData(packed, (unsigned char*)data, node->size);
+}
+
+// ------------------------------ Hashed Directories ------------------------------ //
+/* A directory starts out as a single bucket in blockptrs[0]. When that bucket fills up, the directory turns into an extendible hash:
+ * blockptrs[] then hold index blocks, an array of 2^depth bucket pointers indexed by the low 'depth' bits of the name hash. A full
+ * bucket is split in two on its next hash bit, doubling the index first when the bucket was already using all 'depth' bits. */
+
+void readDirIndex(struct inode* dirnode, int* index){
+    /*Reads the whole bucket pointer array of a hashed directory from its index blocks */
+    int slots = 1 << DIR_DEPTH(dirnode);
+    for(int i = 0; i < DIR_INDEX_BLOCKS(DIR_DEPTH(dirnode)); i++){
+        int n = (slots - i * GEO_DIR_SLOTS < GEO_DIR_SLOTS) ? slots - i * GEO_DIR_SLOTS : GEO_DIR_SLOTS;
+        fsRead(GEO_BLOCK_SIZE * dirnode->blockptrs[i], index + i * GEO_DIR_SLOTS, n * sizeof(int));
+    }
+}
+
+void writeDirIndex(struct inode* dirnode, int* index){
+    /*Writes the bucket pointer array of a hashed directory back into its index blocks */
+    int slots = 1 << DIR_DEPTH(dirnode);
+    for(int i = 0; i < DIR_INDEX_BLOCKS(DIR_DEPTH(dirnode)); i++){
+        int n = (slots - i * GEO_DIR_SLOTS < GEO_DIR_SLOTS) ? slots - i * GEO_DIR_SLOTS : GEO_DIR_SLOTS;
+        fsWrite(GEO_BLOCK_SIZE * dirnode->blockptrs[i], index + i * GEO_DIR_SLOTS, n * sizeof(int));
+    }
+}
+
+int dirBucket(struct inode* dirnode, unsigned hash){
+    /*Returns the bucket block holding names with the given hash - a single pointer read for hashed directories */
+    if(!(dirnode->flags & INODE_HASHED)) return dirnode->blockptrs[0];
+    int slot = hash & ((1u << DIR_DEPTH(dirnode)) - 1), block;
+    fsRead(GEO_BLOCK_SIZE * dirnode->blockptrs[slot / GEO_DIR_SLOTS] + (slot % GEO_DIR_SLOTS) * sizeof(int), &block, sizeof(block));
+    return block;
+}
+
+int dirBuckets(struct inode* dirnode, int* buckets){
+    /*Lists every distinct bucket block of a directory into 'buckets', returning how many there are */
+    if(!(dirnode->flags & INODE_HASHED)){
+        buckets[0] = dirnode->blockptrs[0]; return 1;
+    }
+    static __thread int index[1 << DIR_MAX_DEPTH]; char seen[NUM_BLOCKS] = {0}; int n = 0;
+    readDirIndex(dirnode, index);
+    for(int i = 0; i < (1 << DIR_DEPTH(dirnode)); i++){
+        if(!seen[index[i]]){ seen[index[i]] = 1; buckets[n++] = index[i]; }
+    }
+    return n;
+}
+
+int findDirEntry(struct inode* dirnode, char* name, int after, int* node){
+    /*Looks for an entry named 'name' in a directory. Entries are identified by a handle (bucket block * DIRENTS_PER_BLOCK + position); pass -1 as 'after' for the first match, or the previous handle to continue - all entries with the same name share a bucket. The bucket is read in one go and its name column handed to the name search kernel. Returns the handle and sets 'node', or returns -1 */
+    int block = (after == -1) ? dirBucket(dirnode, nameHash(name)) : after / GEO_DIRENTS;
+    int start = (after == -1) ? 0 : after % GEO_DIRENTS + 1;
+
+    struct dirblock bucket;
+    fsRead((off_t)GEO_BLOCK_SIZE * block, &bucket, sizeof(bucket));
+    int count = (bucket.count < GEO_DIRENTS) ? bucket.count : GEO_DIRENTS; // never scan past the name column, whatever the block holds
+    int entry = scanNames(bucket.name, start, count, nameKey(name));
+    if(entry == -1) return -1;
+    *node = bucket.inode[entry];
+    return block * GEO_DIRENTS + entry;
+}
+
+int splitBucket(struct inode* dirnode, int block, struct dirblock* bucket){
+    /*Splits a full bucket on its next hash bit, moving the entries that have that bit set into a new bucket. The index is doubled first if the bucket already uses every bit of it, and a single bucket directory is turned into a hashed one. Returns -1 if the directory cannot grow any further */
+    static __thread int index[1 << DIR_MAX_DEPTH];
+    bool hashed = dirnode->flags & INODE_HASHED;
+    int depth = hashed ? DIR_DEPTH(dirnode) : 0, doubles = bucket->depth == depth; // every index slot of a bucket at full depth is already distinct, so the index doubles
+    if(doubles && depth == DIR_MAX_DEPTH) return -1;
+
+    // every block the split needs is taken before anything changes, so a full disk leaves the directory as it was: index blocks the doubled
+    // index adds (for a single bucket directory, the first one, taking the bucket's place), then the sibling bucket
+    int first = hashed ? DIR_INDEX_BLOCKS(depth) : 0, last = doubles ? DIR_INDEX_BLOCKS(depth + 1) : first, fresh[9];
+    for(int i = 0; i <= last - first; i++){
+        if((fresh[i] = allocateBlock()) == -1){
+            while(i-- > 0) freeBlock(fresh[i]);
+            return -1;
+        }
+    }
+    if(!hashed) index[0] = block;
+    else readDirIndex(dirnode, index);
+    if(doubles){
+        for(int i = first; i < last; i++) dirnode->blockptrs[i] = fresh[i - first];
+        for(int i = 0; i < (1 << depth); i++) index[(1 << depth) + i] = index[i];
+        depth++; dirnode->flags = (dirnode->flags & ~(0xFF << DIR_DEPTH_SHIFT)) | depth << DIR_DEPTH_SHIFT | INODE_HASHED;
+    }
+
+    int sibling = fresh[last - first];
+    struct dirblock high = {0}; int bit = 1 << bucket->depth, low = 0;
+    bucket->depth++; high.depth = bucket->depth;
+    for(int i = 0; i < bucket->count; i++){ // entries with the next hash bit set move to the sibling, the rest are compacted in place
+        struct dirblock* to = (bucket->hash[i] & bit) ? &high : bucket;
+        int at = (to == &high) ? high.count++ : low++;
+        to->hash[at] = bucket->hash[i]; memcpy(to->name[at], bucket->name[i], FILENAME_MAXLEN); to->inode[at] = bucket->inode[i];
+    }
+    bucket->count = low;
+    for(int i = 0; i < (1 << depth); i++){ // repoint the slots of the old bucket whose next hash bit is set
+        if(index[i] == block && (i & bit)) index[i] = sibling;
+    }
+    fsWrite(BLOCK_SIZE * block, bucket, sizeof(*bucket));
+    fsWrite(BLOCK_SIZE * sibling, &high, sizeof(high));
+    writeDirIndex(dirnode, index);
+    return 0;
+}
+
+struct usage entryUsage(int node){
+    /*Returns what an entry adds to the totals of the directories above it: a directory's subtree totals, or a file's own size and blocks */
+    faultInodes(node);
+    struct inode* entry = &names.node[node];
+    if(entry->dir) return usage[node];
+    return (struct usage){entry->size, fileBlockCount(entry), 1};
+}
+
+void chargeUsage(int directory_inode, int node, int sign){
+    /*Adds (sign 1) or takes away (sign -1) an entry's totals to its directory and every directory above it, up to the root */
+    struct usage part = entryUsage(node);
+    for(int d = directory_inode; ; d = usage[d].parent){
+        faultInodes(d);
+        usage[d].bytes += sign * part.bytes; usage[d].blocks += sign * part.blocks; usage[d].files += sign * part.files;
+        fsWrite(USAGE_TABLE + d * sizeof(struct usage), &usage[d], sizeof(struct usage));
+        if(d == 0) break;
+    }
+}
+
+int addDirEntry(int directory_inode, struct inode* dirnode, char* filename, int node){
+    /*Adds an entry (hash, name and inode number, each into its own column) to the bucket its name hashes to, splitting buckets until there is room, then grows the directory and writes its inode back. Returns -1 if the directory is full */
+    unsigned hash = nameHash(filename);
+    struct dirblock bucket;
+    while(true){
+        int block = dirBucket(dirnode, hash);
+        fsRead(GEO_BLOCK_SIZE * block, &bucket, sizeof(bucket));
+        if(bucket.count < GEO_DIRENTS){
+            int entry = bucket.count++;
+            bucket.hash[entry] = hash; bucket.inode[entry] = node;
+            copyName(bucket.name[entry], filename); // zero pads the name, so names can be compared as whole 8-byte words
+            fsWrite(GEO_BLOCK_SIZE * block, &bucket, sizeof(bucket));
+            break;
+        }
+        if(splitBucket(dirnode, block, &bucket) == -1){
+            writeInode(directory_inode, dirnode); // keep whatever the index grew into
+            printf("Error: Directory '%.*s' is full\n", FILENAME_MAXLEN, dirnode->name); return -1;
+        }
+    }
+    dirnode->size += sizeof(struct dirent);
+    writeInode(directory_inode, dirnode);
+    names.parent[node] = usage[node].parent = directory_inode;
+    fsWrite(USAGE_TABLE + node * sizeof(struct usage) + offsetof(struct usage, parent), &usage[node].parent, sizeof(int));
+    chargeUsage(directory_inode, node, 1);
+    return 0;
+}
+
 int findParentInode(char* filename){
     /*Finds the inode of the parent directory for a given file/dir path by splitting the path based on '/' token, iterating over entries in each directory, and checking if the directory exists in the path or not. If directory is found, its inode is returned */
     if(strcmp(filename, "/") == 0){ // '/' is the root directory, hence error and returns an error
@@ -139,24 +982,19 @@ int findParentInode(char* filename){
 
     char directory[100]; // buffer to store the directory name 
     int directory_inode = 0; // initialize the directory inode to 0, which is the root directory inode
-    struct dirent root_dirent; 
-    struct inode root_dirinode, root_inode; 
+    struct inode root_dirinode; 
 
     // splitting the path based on '/' token and iterating over each directory
     while(sscanf(filename, "/%[^/]%s", directory, filename) == 2){
         bool flag = false; //flag to indicate if directory found
 
         // read the inode of the parent directory from myfs 
-        lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_dirinode, sizeof(struct inode));
-        int size = root_dirinode.size;
-
-        for(int i = 0; i < size; i += sizeof(struct dirent)){ //iterate through the entries in the parent directory
-            lseek(myfs, BLOCK_SIZE * root_dirinode.blockptrs[0] + i, SEEK_SET); read(myfs, (char*)&root_dirent, sizeof(struct dirent));
-            if(strcmp(root_dirent.name, directory) == 0){ //if current entry name matches the directory name, read the inode of the block, check if it is a directory, set flag to true and break
-                lseek(myfs, NUM_BLOCKS + root_dirent.inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
-                if(root_inode.dir == 1){
-                    directory_inode = root_dirent.inode; flag = true; break;
-                } 
+        readInode(directory_inode, &root_dirinode);
+
+        int node, entry = -1;
+        while((entry = findDirEntry(&root_dirinode, directory, entry, &node)) != -1){ //iterate through the entries in the parent directory with a matching name
+            if(INODE_DIR(node)){ // if it is a directory, set flag to true and break
+                directory_inode = node; flag = true; break;
             }
         }
         if(flag == false){ // indicates directory was not found in the path, hence error
@@ -167,92 +1005,112 @@ int findParentInode(char* filename){
     return directory_inode;
 }
 
-int findAvailableDataBlock(int* blockpointers, int blockcount){
-    /*Finds the available data blocks by reading the block occupancy status, and iterating through the data blocks, assigning the indices to the blockpointers. If no available data blocks then an error is shown */
-    int dbi = 1; //Initialize data block index to 1
-    char occupado[NUM_BLOCKS]; //array to store block occupancy status
-    lseek(myfs, 0, SEEK_SET); read(myfs, occupado, NUM_BLOCKS);
-
-    for(int i = 0; i < blockcount; i++){
-        bool flag = false; //flag to indicate if aviailable block found
-        while(dbi <= BLOCK_SIZE){
-            if(occupado[dbi] != (char)1){ // If block not occupied, assign index of available block to blockpointers, increment index, set flag to true, break inner loop and move onto next index
-                blockpointers[i] = dbi; dbi++;
-                flag = true; break;
-            }
-            dbi++;
-        }
-        if(flag == false){ //if no data blocks found, print error.
-            printf("Error: No available data blocks\n"); return -1;
-        }
-    }
-    return 0;
-}
-
 int assassin(char* filename, int directory_inode, int node, int dir){
     // searches for the given path/filename/dirname then writes it into a directory if not found - hence the analogy of assassin xD
-    struct inode root_inode, t_inode;
-    struct dirent curr_entry;
+    struct inode root_inode;
     
     // Read the inode of the parent directory from myfs
-    lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
+    readInode(directory_inode, &root_inode);
     
-    for(int i = 0; i < root_inode.size; i += sizeof(struct dirent)){ // iterate through the entries in the parent directory
-        lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[0] + i, SEEK_SET); read(myfs, (char*)&curr_entry, sizeof(struct dirent));
-        if(strcmp(curr_entry.name, filename) == 0){ // if current entry name matches the filename, read the inode of the block, check if it is a directory, set flag to true and break
-            lseek(myfs, NUM_BLOCKS + curr_entry.inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&t_inode, sizeof(struct inode));
-            if(t_inode.dir == dir){ // if the entry is of the same type as the one we are trying to create, print error and return
-                if(dir == 0) printf("Error: The file '%s' already exists\n", filename);
-                else printf("Error: The directory '%s' already exists\n", filename);
-                return -1;
-            }
+    int t_node, entry = -1;
+    while((entry = findDirEntry(&root_inode, filename, entry, &t_node)) != -1){ // iterate through the entries in the parent directory with a matching name
+        if(INODE_DIR(t_node) == dir){ // if the entry is of the same type as the one we are trying to create, print error and return
+            if(dir == 0) printf("Error: The file '%s' already exists\n", filename);
+            else printf("Error: The directory '%s' already exists\n", filename);
+            return -1;
         }
     }
-    // if the entry is not found, write it into the parent directory
-    lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[0] + root_inode.size, SEEK_SET);
-    curr_entry.namelen = strlen(filename); strcpy(curr_entry.name, filename);
-    curr_entry.inode = node;
-    write(myfs, (char*)&curr_entry, sizeof(struct dirent));
-
-    // update the parent directory's size, and write the updated inode of the parent directory back into myfs)
-    root_inode.size += sizeof(struct dirent);
-    lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&root_inode, sizeof(struct inode));
-    return 0;
+    // if the entry is not found, write it into the parent directory, which also updates the parent directory's size
+    return addDirEntry(directory_inode, &root_inode, filename, node);
 }
 
 int stalker(char* filename, int* block, int* finode, int directory_inode, int dir){
-    /*Searches for a file or directory specified by its inode - directory_inode (hence the name stalker xD). It returns the block index of the found entry (if found), and also updates 'finode' with the corresponding inode number.*/
-    struct inode root_inode; struct dirent root_dirent;
+    /*Searches for a file or directory specified by its inode - directory_inode (hence the name stalker xD). It returns the handle of the found entry (if found), sets 'block' to the bucket holding it, and also updates 'finode' with the corresponding inode number.*/
+    struct inode root_inode;
     // Read the inode of the parent directory from myfs
-    lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
-    int size = root_inode.size, val = -1, i = 0; *block = root_inode.blockptrs[0]; // initialize the block index to the first block of the parent directory
-    while(i < size){ // iterate through the entries in the parent directory
-        lseek(myfs, BLOCK_SIZE * (*block) + i, SEEK_SET); read(myfs, (char*)&root_dirent, sizeof(struct dirent));
-        if(strcmp(root_dirent.name, filename) == 0){ // if current entry name matches the filename, update val and finode, and break. val -2 represents entry found but not the required type
-            val = -2; *finode = root_dirent.inode;
-            struct inode root_inode;
-            lseek(myfs, NUM_BLOCKS + root_dirent.inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
-            if(root_inode.dir == dir) return i; // if the entry is of the same type as the one we are trying to find, return the block index
-        }
-        i += sizeof(struct dirent);
+    readInode(directory_inode, &root_inode);
+    int val = -1, entry = -1, node;
+    while((entry = findDirEntry(&root_inode, filename, entry, &node)) != -1){ // iterate through the entries in the parent directory with a matching name
+        val = -2; *finode = node; *block = entry / GEO_DIRENTS; // val -2 represents entry found but not the required type
+        if(INODE_DIR(node) == dir) return entry; // if the entry is of the same type as the one we are trying to find, return its index
     }
     return val;
 }
 
+int subdir(nstable* table, int dir, char* name){
+    /*Returns the directory named 'name' in directory 'dir', or -1. With no table it is found through the directory index of myfs; readers, who never read myfs, pass a namespace table to scan instead */
+    if(table == NULL){
+        struct inode dirnode; int node, entry = -1;
+        readInode(dir, &dirnode);
+        while((entry = findDirEntry(&dirnode, name, entry, &node)) != -1) if(INODE_DIR(node)) return node; // a file may share the name
+        return -1;
+    }
+    for(int i = 0; i < NUM_INODES; i++) if(table->node[i].used && table->node[i].dir && table->parent[i] == dir && strncmp(table->node[i].name, name, FILENAME_MAXLEN) == 0) return i;
+    return -1;
+}
+
+int walkPath(nstable* table, char* path, char* last){
+    /*Follows an absolute path through its directories (see subdir), every name but the last of which has to be one, and copies the last name into 'last' - "" for the root. Returns the inode of the directory holding it, or -1. Unlike findParentInode it leaves the path alone and prints nothing */
+    int dir = 0; char name[FILENAME_MAXLEN + 1] = "";
+    while(*path == '/') path++;
+    while(*path != '\0'){
+        int len = strcspn(path, "/");
+        if(len > FILENAME_MAXLEN) return -1;
+        if(name[0] != '\0' && (dir = subdir(table, dir, name)) == -1) return -1; // a name with more of the path after it
+        memcpy(name, path, len); name[len] = '\0'; path += len;
+        while(*path == '/') path++;
+    }
+    strcpy(last, name);
+    return dir;
+}
+
+void faultPath(char* path){
+    /*Pages in the inode state a lookup of 'path' reads - its directories and every entry with its last name - or the whole table for an empty path. Readers ask for it when their table does not hold every page yet */
+    char last[FILENAME_MAXLEN + 1]; struct inode dirnode; int node, entry = -1;
+    if(path[0] == '\0'){ pageAllInodes(); return; }
+    int dir = walkPath(NULL, path, last);
+    faultInodes(0);
+    if(dir == -1 || last[0] == '\0') return;
+    readInode(dir, &dirnode);
+    while((entry = findDirEntry(&dirnode, last, entry, &node)) != -1) faultInodes(node);
+}
+
 int execution(int directory_inode, int directory_entry){
-    /*Removes / deletes an entry from a directory specified by its inode at the given entry offset. Hence the name executioner xD - since it 'executes'(deletes) an entry */
-    struct inode root_inode; struct dirent root_dirent;
+    /*Removes / deletes the entry with the given handle from a directory specified by its inode. Hence the name executioner xD - since it 'executes'(deletes) an entry. The last entry of the bucket takes its place, and a bucket left small enough is merged back with its buddy */
+    struct inode root_inode; struct dirblock bucket;
+    int block = directory_entry / GEO_DIRENTS, entry = directory_entry % GEO_DIRENTS;
 
-    lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
-    int size = root_inode.size, blockOff = root_inode.blockptrs[0];
+    readInode(directory_inode, &root_inode);
+    fsRead(GEO_BLOCK_SIZE * block, &bucket, sizeof(bucket));
 
-    if(directory_entry != size - sizeof(struct dirent)){ // if the entry to be deleted is not the last entry in the directory, replace it with the last entry
-        lseek(myfs, BLOCK_SIZE * blockOff + size - sizeof(struct dirent), SEEK_SET); read(myfs, (char*)&root_dirent, sizeof(struct dirent));
-        lseek(myfs, BLOCK_SIZE * blockOff + directory_entry, SEEK_SET); write(myfs, (char*)&root_dirent, sizeof(struct dirent));
+    int last = --bucket.count, child = bucket.inode[entry];
+    if(entry != last){ // if the entry to be deleted is not the last entry in the bucket, replace it with the last entry, column by column
+        bucket.hash[entry] = bucket.hash[last]; memcpy(bucket.name[entry], bucket.name[last], FILENAME_MAXLEN); bucket.inode[entry] = bucket.inode[last];
+    }
+    memset(bucket.name[last], 0, FILENAME_MAXLEN);
+
+    if((root_inode.flags & INODE_HASHED) && bucket.depth > 0){ // try merging with the buddy bucket, the one differing in the highest hash bit of this bucket
+        static __thread int index[1 << DIR_MAX_DEPTH]; struct dirblock buddy;
+        readDirIndex(&root_inode, index);
+        int slot = 0, bit = 1 << (bucket.depth - 1);
+        while(index[slot] != block) slot++;
+        int other = index[slot ^ bit];
+        fsRead(GEO_BLOCK_SIZE * other, &buddy, sizeof(buddy));
+        if(other != block && buddy.depth == bucket.depth && bucket.count + buddy.count <= GEO_DIRENTS){
+            for(int i = 0; i < buddy.count; i++, bucket.count++){
+                bucket.hash[bucket.count] = buddy.hash[i]; memcpy(bucket.name[bucket.count], buddy.name[i], FILENAME_MAXLEN); bucket.inode[bucket.count] = buddy.inode[i];
+            }
+            bucket.depth--;
+            for(int i = 0; i < (1 << DIR_DEPTH(&root_inode)); i++) if(index[i] == other) index[i] = block;
+            writeDirIndex(&root_inode, index); freeBlock(other);
+        }
     }
+    fsWrite(GEO_BLOCK_SIZE * block, &bucket, sizeof(bucket));
+
     // update the size of the directory, and write the updated inode of the directory back into myfs
-    root_inode.size = size - sizeof(struct dirent);
-    lseek(myfs, NUM_BLOCKS + directory_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&root_inode, sizeof(struct inode));
+    root_inode.size -= sizeof(struct dirent);
+    writeInode(directory_inode, &root_inode);
+    if(child >= 0 && child < GEO_NUM_INODES && INODE_USED(child)) chargeUsage(directory_inode, child, -1); // a dangling entry fsck removes names no real inode, and nothing was charged for it
 
     return 0;
 }
@@ -261,37 +1119,81 @@ void successiveExecution(int finode){
     /*Recursively removes / deletes a file or directory specified by the inode - since its recursive deletion, hence analogy to successive executions - killing spree lessgooo*/
     struct inode root_inode;
     // Read the inode of the file/directory from myfs
-	lseek(myfs, NUM_BLOCKS + finode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(inode));
+	readInode(finode, &root_inode);
 
 	root_inode.used = 0; // mark inode as unused, and write the updated inode back into myfs
-	lseek(myfs, NUM_BLOCKS + finode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&root_inode, sizeof(struct inode));
+	writeInode(finode, &root_inode);
 	
-	char nc = '\0', blockData[BLOCK_SIZE]; // null character and block data initialized, with each byte of block data set to null character
-	for (int i = 0; i < BLOCK_SIZE; i++) blockData[i] = nc;
-
-	if(root_inode.dir == 1){ // if the inode is of a directory, recursively delete all the files and directories in it
-		lseek(myfs, root_inode.blockptrs[0], SEEK_SET); write(myfs, &nc, 1);
-		struct dirent root_dirent;
-		for(int i = 0; i < root_inode.size; i += sizeof(struct dirent)){
-			lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[0], SEEK_SET); read(myfs, &root_dirent, sizeof(struct dirent));
-			successiveExecution(root_dirent.inode);
+	if(root_inode.dir == 1){ // if the inode is of a directory, recursively delete all the files and directories in every bucket, then free the buckets and index blocks
+		int buckets[NUM_BLOCKS], n = dirBuckets(&root_inode, buckets);
+		struct dirblock bucket;
+		for(int b = 0; b < n; b++){
+			fsRead(BLOCK_SIZE * buckets[b], &bucket, sizeof(bucket));
+			for(int i = 0; i < bucket.count; i++) successiveExecution(bucket.inode[i]);
+			freeBlock(buckets[b]);
 		}
-		lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[0], SEEK_SET); write(myfs, &blockData, BLOCK_SIZE);
+		if(root_inode.flags & INODE_HASHED) for(int i = 0; i < DIR_INDEX_BLOCKS(DIR_DEPTH(&root_inode)); i++) freeBlock(root_inode.blockptrs[i]);
 	}
-	else if(root_inode.dir == 0){ // if the inode is of a file, mark the data blocks as unused, and write the null character into the data blocks, thus removing data blocks
-        int size = root_inode.size, blockcount = root_inode.size / BLOCK_SIZE;
-		if (root_inode.size > blockcount * BLOCK_SIZE) blockcount++;
-
-		for(int i = 0; i < blockcount; i++){
-			lseek(myfs, root_inode.blockptrs[i], SEEK_SET); write(myfs, &nc, 1);
-			lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[i], SEEK_SET);
-			if (size > BLOCK_SIZE){
-                write(myfs, blockData, BLOCK_SIZE); size -= BLOCK_SIZE;
-            }
-			else write(myfs, blockData, size);
-		}
-		
+	else if(root_inode.dir == 0) freeFileData(&root_inode); // if the inode is of a file, clear and free its data blocks and fragments
+}
+
+// ------------------------------ Lock-free Readers ------------------------------ //
+/* LL and STAT never read myfs, they read the namespace table. The writer of an image publishes a whole command's changes at once:
+ * it bumps the published table's sequence number to odd, copies its own table over, and bumps the number back to even. A reader
+ * copies the published table and starts over if the number was odd or moved in the meantime, so it always gets the state between
+ * two commands - without taking a lock, and without ever holding the writer up. In the sharded mode LL and STAT are answered by
+ * reader threads while the shards' executors keep running. */
+
+void publishNamespace(){
+    /*Publishes the writer's namespace table, if the last command changed it */
+    if(!namesChanged) return;
+    unsigned seq = published->seq;
+    __atomic_store_n(&published->seq, seq + 1, __ATOMIC_RELAXED); // odd: readers copying now will retry
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(published->node, names.node, sizeof(names.node)); memcpy(published->parent, names.parent, sizeof(names.parent));
+    __atomic_store_n(&published->paged, names.paged, __ATOMIC_RELAXED);
+    __atomic_store_n(&published->seq, seq + 2, __ATOMIC_RELEASE);
+    namesChanged = false;
+}
+
+void readNamespace(nstable* table, nstable* copy){
+    /*Copies a published namespace table, retrying until the writer did not publish in the middle of the copy */
+    unsigned before, after;
+    do{
+        while((before = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE)) & 1) sched_yield(); // the writer is publishing
+        memcpy(copy->node, table->node, sizeof(table->node)); memcpy(copy->parent, table->parent, sizeof(table->parent));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&table->seq, __ATOMIC_RELAXED);
+    } while(before != after);
+}
+
+void printEntry(struct inode* node, int i){
+    /*Prints the type, name, size and inode number of an entry, as STAT shows it */
+    printf("%s: %.*s %d, inode %d\n", node->dir ? "Directory" : "File", FILENAME_MAXLEN, node->name, node->size, i);
+}
+
+void listNamespace(nstable* table){
+    /*Prints every entry of a published namespace table, as LL lists them */
+    nstable view; readNamespace(table, &view);
+    flockfile(stdout); // one listing comes out in one piece, even with shards printing alongside
+    printf("\n\nMYFS has the following files and directories stored in the system:\n");
+    for(int i = 0; i < NUM_INODES; i++){ // iterate through the used inodes, if its a file print 'File', if its a directory print 'Directory'
+        if(!view.node[i].used) continue;
+        if(view.node[i].dir == 0) printf("File: %.*s %d\n", FILENAME_MAXLEN, view.node[i].name, view.node[i].size);
+        else printf("Directory: %.*s %d\n", FILENAME_MAXLEN, view.node[i].name, view.node[i].size);
     }
+    funlockfile(stdout);
+}
+
+void statPath(nstable* table, char* path){
+    /*Prints every entry at 'path' in a published namespace table - a file and a directory may share a name */
+    nstable view; readNamespace(table, &view);
+    char last[FILENAME_MAXLEN + 1]; int dir = walkPath(&view, path, last), found = 0;
+    for(int i = 0; dir != -1 && i < NUM_INODES; i++){
+        if(last[0] == '\0' ? i != 0 : !view.node[i].used || view.parent[i] != dir || strncmp(view.node[i].name, last, FILENAME_MAXLEN) != 0) continue;
+        printEntry(&view.node[i], i); found++;
+    }
+    if(!found) printf("Error: '%s' does not exist\n", path);
 }
 
 // ------------------------------ Create File ------------------------------ //
@@ -306,36 +1208,26 @@ int CR(char* filename, int size){ // Create a file with the given filename and s
     if(blockcount > 8){ // if the file size exceeds the maximum size limit, return an error
         printf("Filesize exceeding size limit\n"); return -1;
     }
-    
-    if(findAvailableDataBlock(finode.blockptrs, blockcount) == -1) return -1; // find available data blocks
 
     int available_inode = findAvailableInode(); // find available inode
     if(available_inode == -1) return -1;
 
-    if(assassin(filename, directory_inode, available_inode, 0) == -1) return -1; // write the file into the parent directory
+    // generate random data for the file, then store it - inline, in blocks, compressed and/or with a packed tail, as it fits best
+    char data[8 * BLOCK_SIZE];
+    for(int j = 0; j < size; j++) data[j] = (char)(97 + (rand() % 26));
+    if(writeFileData(&finode, data, size) == -1) return -1;
 
     // Initialize the file inode - finode
     finode.dir = 0; // 0 since its a file, not a directory
-    strcpy(finode.name, filename); // set the name of the file
-    finode.size = size; // set its size
+    copyName(finode.name, filename); // set the name of the file - never past the field, where it would land on size
     finode.used = 1; // yes it is in use
-    finode.rsvd = 0; // no it is not reserved for future use
 
     // write the inode of the file into myfs
-    lseek(myfs, NUM_BLOCKS + available_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&finode, sizeof(struct inode));
-
-    char c = (char)1, data[BLOCK_SIZE]; // mark the data block as occupied, and initialize the data array
-    int buffsize = BLOCK_SIZE; // buffer size is set to BLOCK_SIZE
-    for(int i = 0; i < blockcount; i++){ // iterate through the data blocks
-        // mark the data block as occupied
-        lseek(myfs, finode.blockptrs[i], SEEK_SET); write(myfs, &c, 1);
+    writeInode(available_inode, &finode);
 
-        if(size > BLOCK_SIZE) size -= BLOCK_SIZE;
-        else buffsize = size;
-
-        // generate random data for the file and write the data into the data block
-        for(int j = 0; j < buffsize; j++) data[j] = (char)(97 + (rand() % 26)); 
-        lseek(myfs, BLOCK_SIZE * finode.blockptrs[i], SEEK_SET); write(myfs, data, buffsize);
+    // write the file into the parent directory last, since growing a hashed directory may allocate blocks of its own. If that fails the file is removed again
+    if(assassin(filename, directory_inode, available_inode, 0) == -1){
+        successiveExecution(available_inode); return -1;
     }
     printf("File '%s' created successfully\n", filename);
     return 0;
@@ -359,58 +1251,49 @@ int DL(char* filename){ // Delete a file with the given filename
 }
 
 // ------------------------------ Copy File ------------------------------ //
-int CP(char *srcname, char *dstname){ // Copy a file with the given filename to a destination with the given filename
-    int src_inode = findParentInode(srcname), dst_inode = findParentInode(dstname); // find the inode of the parent directory where the file will be copied from and copied to
-    if(src_inode == -1 || dst_inode == -1) return -1;
-
-    int block_og, block_cp, finode_og, finode_cp; // block and inode of the original file and the file to be copied to
-    // find the inode of the file to be copied from and the file to be copied to
-    int source_entry = stalker(srcname, &block_og, &finode_og, src_inode, 0), directory_entry = stalker(dstname, &block_cp, &finode_cp, dst_inode, 0);
-    if(source_entry < 0){ // if the file to be copied from is not found, return an error
-        printf("Error: File '%s' does not exist, or you've provided a directory - can't handle directories\n", srcname); return -1;
-    }
-
-    struct inode root_inode;
-    lseek(myfs, NUM_BLOCKS + finode_og * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&root_inode, sizeof(struct inode));
-
-    int blockcount = (root_inode.size % BLOCK_SIZE != 0) + (root_inode.size / BLOCK_SIZE); // number of blocks needed to store the file
-    int blockData[blockcount]; // array to store the block indices of the file to be copied from
-    for(int i = 0; i < blockcount; i++) blockData[i] = root_inode.blockptrs[i];
+int copyInto(int dst_inode, char* dstname, char* data, int size){
+    /*Stores 'size' bytes of contents as the file 'dstname' in the directory 'dst_inode', replacing a file of that name. The destination half of CP, also used for copies between shards */
+    int block_cp, finode_cp; // block and inode of the file to be copied to
+    int directory_entry = stalker(dstname, &block_cp, &finode_cp, dst_inode, 0);
 
-    strcpy(root_inode.name, dstname); // set the name of the file to be copied to
-    
-    if(findAvailableDataBlock(root_inode.blockptrs, blockcount) == -1) return -1;
-    
     int available_inode = findAvailableInode();
     if(available_inode == -1) return -1;
 
-    if(directory_entry > -1){ // if the file to be copied to already exists, delete it
-        struct dirent root_dirent;
-        lseek(myfs, BLOCK_SIZE * block_cp + directory_entry, SEEK_SET); read(myfs, (char*)&root_dirent, sizeof(struct dirent));
-        successiveExecution(root_dirent.inode); execution(dst_inode, directory_entry);
-    }
-    // write the updated destination file inode into myfs
-    lseek(myfs, NUM_BLOCKS + available_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&root_inode, sizeof(struct inode));
+    // store the contents for the copy, laid out (and compressed) afresh
+    struct inode copy_inode;
+    if(writeFileData(&copy_inode, data, size) == -1) return -1;
+    copyName(copy_inode.name, dstname); // set the name of the file to be copied to
+    copy_inode.dir = 0; copy_inode.used = 1;
 
-    char temp_data[BLOCK_SIZE]; // temporary data array
-    for(int i = 0; i < blockcount; i++){ // copy data from the original file to the copied file
-        lseek(myfs, BLOCK_SIZE * blockData[i], SEEK_SET); read(myfs, temp_data, BLOCK_SIZE);
-        lseek(myfs, BLOCK_SIZE * root_inode.blockptrs[i], SEEK_SET); write(myfs, temp_data, BLOCK_SIZE);
+    if(directory_entry > -1){ // if the file to be copied to already exists, delete it - its entry first, while its inode still says what to uncharge
+        execution(dst_inode, directory_entry); successiveExecution(finode_cp);
     }
+    // write the destination file inode into myfs
+    writeInode(available_inode, &copy_inode);
+
+    struct inode temp_inode;
+    // read the inode of the destination directory from myfs, then add the destination file to it
+    readInode(dst_inode, &temp_inode);
+    if(addDirEntry(dst_inode, &temp_inode, dstname, available_inode) == -1){ // the destination directory is full, so the copy is dropped
+        successiveExecution(available_inode); return -1;
+    }
+    return 0;
+}
 
-    struct inode temp_inode; struct dirent temp_dirent;
-    // read the inode of the destination directory from myfs
-    lseek(myfs, NUM_BLOCKS + dst_inode * sizeof(struct inode), SEEK_SET); read(myfs, (char*)&temp_inode, sizeof(struct inode));
-
-    int size = temp_inode.size, blockOff = temp_inode.blockptrs[0];
+int CP(char *srcname, char *dstname){ // Copy a file with the given filename to a destination with the given filename
+    int src_inode = findParentInode(srcname), dst_inode = findParentInode(dstname); // find the inode of the parent directory where the file will be copied from and copied to
+    if(src_inode == -1 || dst_inode == -1) return -1;
 
-    strcpy(temp_dirent.name, dstname); // set the name of the destination file, and update the destination directory by writing the updated directory entry into myfs
-    temp_dirent.namelen = strlen(dstname); temp_dirent.inode = available_inode;
+    int block_og, finode_og; // block and inode of the original file
+    if(stalker(srcname, &block_og, &finode_og, src_inode, 0) < 0){ // if the file to be copied from is not found, return an error
+        printf("Error: File '%s' does not exist, or you've provided a directory - can't handle directories\n", srcname); return -1;
+    }
 
-    lseek(myfs, BLOCK_SIZE * blockOff + size, SEEK_SET); write(myfs, (char*)&temp_dirent, sizeof(struct dirent));
-    // update the size of the destination directory, and write the updated inode of the destination directory back into myfs
-    temp_inode.size = size + sizeof(struct dirent);
-    lseek(myfs, NUM_BLOCKS + dst_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&temp_inode, sizeof(struct inode));
+    // read the source contents, then store them as the destination file
+    struct inode root_inode; char data[8 * BLOCK_SIZE];
+    readInode(finode_og, &root_inode);
+    readFileData(&root_inode, data);
+    if(copyInto(dst_inode, dstname, data, root_inode.size) == -1) return -1;
     printf("File '%s' copied successfully to destination '%s' \n", srcname, dstname);
     return 0;
 }
@@ -435,20 +1318,26 @@ int CD(char* dirname){ // Create a directory with the given dirname
     int available_inode = findAvailableInode();
     if(available_inode == -1) return -1; // Return an error if no available inodes
 
-    if(assassin(dirname, parent_inode, available_inode, 1) == -1) return -1; // Return an error if directory already exists
-
     struct inode directory_inode; // Initialize the directory inode
     directory_inode.dir = 1; // 1 since its a directory, not a file
-    strcpy(directory_inode.name, dirname); // set the name of the directory
+    copyName(directory_inode.name, dirname); // set the name of the directory
     directory_inode.blockptrs[0] = block; // set its block pointer
     directory_inode.size = 0; // 0 since its an empty directry for now
     directory_inode.used = 1; // yes it is in use
-    directory_inode.rsvd = 0; // no it is not reserved for future use
-
-    char c = (char)1; 
-    // Mark the data block as occupied and write the directory inode into myfs
-    lseek(myfs, block, SEEK_SET); write(myfs, &c, 1);
-    lseek(myfs, NUM_BLOCKS + available_inode * sizeof(struct inode), SEEK_SET); write(myfs, (char*)&directory_inode, sizeof(struct inode));
+    directory_inode.flags = 0; // plain block-backed entry
+
+    char c = (char)1; struct dirblock bucket = {0}; // an empty bucket, using none of the hash bits
+    // Mark the data block as occupied, write the empty bucket into it and write the directory inode into myfs
+    fsWrite(block, &c, 1);
+    fsWrite(BLOCK_SIZE * block, &bucket, sizeof(bucket));
+    writeInode(available_inode, &directory_inode);
+    memset(&usage[available_inode], 0, sizeof(struct usage)); // an empty subtree, whatever the inode held before
+    fsWrite(USAGE_TABLE + available_inode * sizeof(struct usage), &usage[available_inode], sizeof(struct usage));
+
+    // add the directory to its parent last, and remove it again if it already exists there
+    if(assassin(dirname, parent_inode, available_inode, 1) == -1){
+        successiveExecution(available_inode); return -1; // Return an error if directory already exists
+    }
     printf("Directory '%s' created successfully\n", dirname);
     return 0;
 }
@@ -472,54 +1361,935 @@ int DD(char* dirname){ // Delete a directory with the given dirname
 
 // ------------------------------ List all Files ------------------------------ //
 
-void LL(){ // List all files and directories in the file system
-    printf("\n\nMYFS has the following files and directories stored in the system:\n");
-    struct inode inodes[NUM_INODES]; // array to store the inodes
-    lseek(myfs, NUM_BLOCKS, SEEK_SET); read(myfs, inodes, NUM_INODES * sizeof(struct inode)); // read the inodes from myfs
-    for(int i = 0; i < NUM_INODES; i++){ // iterate through the inodes, if its a file print 'File', if its a directory print 'Directory'
-        if(inodes[i].used == 1 && inodes[i].dir == 0) printf("File: %s %d\n", inodes[i].name, inodes[i].size);
-        else if(inodes[i].used == 1 && inodes[i].dir == 1) printf("Directory: %s %d\n", inodes[i].name, inodes[i].size);
+void LL(){ // List all files and directories in the file system, from the published namespace table
+    pageAllInodes(); publishNamespace(); // the listing covers every inode
+    listNamespace(published);
+}
+
+// ------------------------------ Stat ------------------------------ //
+
+void STAT(char* path){ // Show the type and size of every entry at the given path, found through the directory index
+    char last[FILENAME_MAXLEN + 1]; struct inode dirnode;
+    int dir = walkPath(NULL, path, last), found = 0, node, entry = -1;
+    if(dir != -1 && last[0] == '\0'){ // the root
+        faultInodes(0); printEntry(&names.node[0], 0); return;
+    }
+    if(dir != -1) readInode(dir, &dirnode);
+    while(dir != -1 && (entry = findDirEntry(&dirnode, last, entry, &node)) != -1){
+        faultInodes(node); printEntry(&names.node[node], node); found++;
+    }
+    if(!found) printf("Error: '%s' does not exist\n", path);
+}
+
+// ------------------------------ Disk Usage ------------------------------ //
+/* Every directory keeps the totals of its whole subtree in the usage table: file bytes, whole file blocks and files. Linking an
+ * entry into a directory (addDirEntry) adds the entry's totals to that directory and each one above it, unlinking it (execution)
+ * takes them away again, so the totals are never recounted and DU answers for any subtree at once. Packed tails and directory
+ * buckets are not counted as blocks. */
+
+struct usage tallyUsage(int d){
+    /*Recounts the totals of directory d's subtree from its entries, storing them for d and every directory below it */
+    struct usage total = {0}, part; struct dirblock bucket; struct inode node; int buckets[NUM_BLOCKS];
+    readInode(d, &node); total.parent = usage[d].parent;
+    for(int b = 0, n = dirBuckets(&node, buckets); b < n; b++){
+        fsRead(BLOCK_SIZE * buckets[b], &bucket, sizeof(bucket));
+        for(int e = 0; e < bucket.count; e++){
+            if(bucket.inode[e] == d) continue; // the root names itself
+            readInode(bucket.inode[e], &node);
+            if(usage[bucket.inode[e]].parent != d){
+                usage[bucket.inode[e]].parent = d; names.parent[bucket.inode[e]] = d;
+                fsWrite(USAGE_TABLE + bucket.inode[e] * sizeof(struct usage), &usage[bucket.inode[e]], sizeof(struct usage));
+            }
+            if(INODE_DIR(bucket.inode[e])) part = tallyUsage(bucket.inode[e]);
+            else part = (struct usage){node.size, fileBlockCount(&node), 1};
+            total.bytes += part.bytes; total.blocks += part.blocks; total.files += part.files;
+        }
+    }
+    if(memcmp(&usage[d], &total, sizeof(total)) != 0){
+        usage[d] = total; fsWrite(USAGE_TABLE + d * sizeof(struct usage), &usage[d], sizeof(struct usage));
+    }
+    return total;
+}
+
+void DU(char* path){ // Show the file bytes, blocks and files stored under a path, from the totals kept by every directory
+    char last[FILENAME_MAXLEN + 1]; struct inode dirnode;
+    int dir = walkPath(NULL, path, last), node = -1, entry = -1, match;
+    if(dir != -1 && last[0] == '\0') node = 0; // the root
+    else if(dir != -1){ // a directory wins over a file of the same name
+        readInode(dir, &dirnode);
+        while((entry = findDirEntry(&dirnode, last, entry, &match)) != -1 && (node == -1 || !INODE_DIR(node))) node = match;
+    }
+    if(node == -1){
+        printf("Error: '%s' does not exist\n", path); return;
+    }
+    struct usage total = entryUsage(node);
+    printf("%s: %d byte(s) in %d file(s), %d block(s)\n", path, total.bytes, total.files, total.blocks);
+}
+
+// ------------------------------ Scrub ------------------------------ //
+
+typedef struct scrubjob {
+    int first, stride; // blocks first, first + stride, ... are checked by this worker
+    int errors;        // number of blocks that failed their checksum
+    imageview* view;   // the image being scrubbed
+} scrubjob;
+
+void* scrubWorker(void* arg){ // verifies a stripe of blocks, reading with pread so workers never share a file offset
+    scrubjob* job = arg; char data[BLOCK_SIZE];
+    adoptImage(job->view);
+    for(int b = job->first; b < NUM_BLOCKS; b += job->stride){
+        pread(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * b);
+        unsigned expected = (b == CRC_BLOCK) ? ((unsigned*)data)[CRC_BLOCK] : blockCrc[b];
+        if(checksumBlock(b, data) != expected){
+            printf("Error: Checksum mismatch in block %d\n", b); job->errors++;
+        }
+    }
+    return NULL;
+}
+
+void SCRUB(){ // Verify every block of myfs against its checksum, with one worker thread per CPU
+    syncChecksums(); // the checksums of this session's writes are brought up to date first
+    int workers = sysconf(_SC_NPROCESSORS_ONLN), errors = 0;
+    if(workers < 1) workers = 1;
+    if(workers > NUM_BLOCKS) workers = NUM_BLOCKS;
+    pthread_t threads[workers]; scrubjob jobs[workers]; imageview view;
+    shareImage(&view);
+    for(int i = 0; i < workers; i++){
+        jobs[i] = (scrubjob){i, workers, 0, &view};
+        pthread_create(&threads[i], NULL, scrubWorker, &jobs[i]);
+    }
+    for(int i = 0; i < workers; i++){
+        pthread_join(threads[i], NULL); errors += jobs[i].errors;
+    }
+    printf("Scrub complete: %d blocks verified by %d thread(s), %d checksum error(s)\n", NUM_BLOCKS, workers, errors);
+}
+
+// ------------------------------ Deduplicate ------------------------------ //
+
+void DEDUP(){ // Index the whole blocks of every file, pointing files with identical blocks at one copy and freeing the others
+    syncChecksums(); // the table is keyed by checksum, so they have to be current
+    int indexed = 0, freed = 0; char data[BLOCK_SIZE];
+    struct inode node;
+    for(int i = 0; i < NUM_INODES; i++){
+        if(!INODE_USED(i) || INODE_DIR(i)) continue; // files only
+        readInode(i, &node);
+        if(node.flags & INODE_INLINE) continue;
+        bool changed = false;
+        for(int p = 0; p < storedSize(&node) / BLOCK_SIZE; p++){ // whole blocks only, a partial last block is never shared
+            int block = node.blockptrs[p];
+            if(blockRefs[block] > 0) continue; // already indexed
+            fsRead(BLOCK_SIZE * block, data, BLOCK_SIZE);
+            int twin = dedupLookup(data);
+            if(twin != -1){ // repoint the file at the stored copy, and drop its own
+                setBlockRefs(twin, blockRefs[twin] + 1); node.blockptrs[p] = twin; changed = true;
+                freeBlock(block); freed++;
+            }
+            else{
+                setBlockRefs(block, 1); dedupInsert(block); indexed++;
+            }
+        }
+        if(changed) writeInode(i, &node);
+    }
+    printf("Dedup complete: %d block(s) indexed, %d duplicate block(s) freed\n", indexed, freed);
+}
+
+// ------------------------------ Consistency Check ------------------------------ //
+/* A run clears the clean flag in the superblock header when it opens myfs and sets it again once everything is written back, so a
+ * flag still cleared at startup means the last run crashed. Only then is FSCK run: it rebuilds what the free block list, inode
+ * bitmap, reference counts and directory sizes should say from the directory tree and the inodes, and repairs whatever differs. The
+ * directory pass and the inode pass only read myfs, so they run side by side on their own threads; the repairs are made afterwards. */
+
+typedef struct fsckdirs { // what the directory pass finds, walking the tree from the root
+    unsigned char reachable[NUM_INODES]; // inodes named by an entry of a reachable directory
+    char blocks[NUM_BLOCKS];             // buckets and index blocks of reachable directories
+    int entries[NUM_INODES];             // entries found in each reachable directory
+    int danglingDir, dangling;           // directory inode and handle of an entry naming an unused inode, or -1
+    imageview* view;                     // the image being checked
+} fsckdirs;
+
+typedef struct fsckinodes { // what the inode pass finds, reading every used file inode
+    unsigned char refs[NUM_INODES][NUM_BLOCKS];  // whole block pointers of each file to each block
+    unsigned short frags[NUM_INODES][NUM_BLOCKS]; // fragment slots held by the packed tail of each file
+    imageview* view;                              // the image being checked
+} fsckinodes;
+
+bool validBlock(int block){
+    /*Checks that a block pointer lands on a data block, so a damaged inode cannot send the checker outside myfs */
+    return block > CRC_BLOCK && block != REF_BLOCK && block < NUM_BLOCKS;
+}
+
+void* fsckDirPass(void* arg){ // walks the directory tree from the root, recording reachable inodes, directory blocks and entry counts
+    fsckdirs* pass = arg; struct inode dir; struct dirblock bucket;
+    adoptImage(pass->view);
+    int stack[NUM_INODES], top = 0, buckets[NUM_BLOCKS];
+    pass->danglingDir = pass->dangling = -1;
+    stack[top++] = 0; pass->reachable[0] = 1;
+    while(top > 0){
+        int d = stack[--top];
+        readInode(d, &dir);
+        if(dir.flags & INODE_HASHED) for(int i = 0; i < DIR_INDEX_BLOCKS(DIR_DEPTH(&dir)); i++) if(validBlock(dir.blockptrs[i])) pass->blocks[dir.blockptrs[i]] = 1;
+        int n = dirBuckets(&dir, buckets);
+        for(int b = 0; b < n; b++){
+            if(!validBlock(buckets[b])){
+                printf("fsck: directory '%s' points outside myfs\n", dir.name); continue;
+            }
+            pass->blocks[buckets[b]] = 1;
+            fsRead(BLOCK_SIZE * buckets[b], &bucket, sizeof(bucket));
+            for(int i = 0; i < bucket.count && i < DIRENTS_PER_BLOCK; i++){
+                int child = bucket.inode[i]; pass->entries[d]++;
+                if(child < 0 || child >= NUM_INODES || !MAP_TEST(inodeUsedMap, child)){ // the entry outlived its inode
+                    if(pass->dangling == -1){ pass->danglingDir = d; pass->dangling = buckets[b] * DIRENTS_PER_BLOCK + i; }
+                    continue;
+                }
+                if(pass->reachable[child]) continue; // '.' of the root, or a directory already walked
+                pass->reachable[child] = 1;
+                if(MAP_TEST(inodeDirMap, child)) stack[top++] = child;
+            }
+        }
+    }
+    return NULL;
+}
+
+void* fsckInodePass(void* arg){ // reads every used file inode, recording the blocks and fragment slots it holds
+    fsckinodes* pass = arg; struct inode node;
+    adoptImage(pass->view);
+    for(int i = 0; i < NUM_INODES; i++){
+        if(!MAP_TEST(inodeUsedMap, i) || MAP_TEST(inodeDirMap, i)) continue; // directories are covered by the directory pass
+        readInode(i, &node);
+        int blockcount = fileBlockCount(&node);
+        for(int p = 0; p < blockcount && p < 8; p++){
+            if(validBlock(node.blockptrs[p])) pass->refs[i][node.blockptrs[p]]++;
+            else printf("fsck: file '%.*s' points outside myfs\n", FILENAME_MAXLEN, node.name);
+        }
+        if((node.flags & INODE_TAIL) && blockcount < 8){
+            int addr = node.blockptrs[blockcount], block = addr / BLOCK_SIZE, slot = (addr % BLOCK_SIZE) / FRAG_SIZE;
+            if(!validBlock(block) || slot == 0 || slot + tailFragments(storedSize(&node)) > FRAGS_PER_BLOCK) printf("fsck: file '%.*s' points outside myfs\n", FILENAME_MAXLEN, node.name);
+            else for(int k = 0; k < tailFragments(storedSize(&node)); k++) pass->frags[i][block] |= 1 << (slot + k);
+        }
+    }
+    return NULL;
+}
+
+void FSCK(){ // Check myfs against its directory tree after an unclean shutdown, repairing what differs
+    static __thread fsckdirs dirs; static __thread fsckinodes inodes; static __thread imageview view; pthread_t threads[2];
+    int repairs = 0;
+    pageAllInodes(); // both passes work from the whole inode bitmaps
+    sb.freeInode = 0; // freed inodes of the crashed run may lie below the hint it last wrote
+
+    while(1){ // both passes, then one dangling entry removed at a time - removing an entry moves the others in its bucket
+        memset(&dirs, 0, sizeof(dirs)); memset(&inodes, 0, sizeof(inodes));
+        shareImage(&view); dirs.view = inodes.view = &view;
+        pthread_create(&threads[0], NULL, fsckDirPass, &dirs);
+        pthread_create(&threads[1], NULL, fsckInodePass, &inodes);
+        pthread_join(threads[0], NULL); pthread_join(threads[1], NULL);
+        if(dirs.dangling == -1) break;
+        printf("fsck: removed a directory entry naming a free inode\n"); repairs++;
+        execution(dirs.danglingDir, dirs.dangling);
+    }
+
+    // inodes no directory names are freed, and the blocks of the rest add up to the expected free block list
+    char expected[NUM_BLOCKS], occupado[NUM_BLOCKS]; unsigned short frags[NUM_BLOCKS] = {0}; int refs[NUM_BLOCKS] = {0};
+    memcpy(expected, dirs.blocks, NUM_BLOCKS); expected[0] = expected[CRC_BLOCK] = expected[REF_BLOCK] = 1;
+    struct inode node;
+    for(int i = 0; i < NUM_INODES; i++){
+        if(!MAP_TEST(inodeUsedMap, i)) continue;
+        readInode(i, &node);
+        if(!dirs.reachable[i]){
+            printf("fsck: freed inode %d ('%.*s'), no directory names it\n", i, FILENAME_MAXLEN, node.name); repairs++;
+            node.used = 0; writeInode(i, &node); continue;
+        }
+        if(node.dir && node.size != dirs.entries[i] * (int)sizeof(struct dirent)){
+            printf("fsck: directory '%.*s' has %d entries, fixed its size\n", FILENAME_MAXLEN, node.name, dirs.entries[i]); repairs++;
+            node.size = dirs.entries[i] * sizeof(struct dirent); writeInode(i, &node);
+        }
+        for(int b = 0; b < NUM_BLOCKS; b++){
+            if(inodes.refs[i][b]){ refs[b] += inodes.refs[i][b]; expected[b] = 1; }
+            if(inodes.frags[i][b]){ frags[b] |= inodes.frags[i][b]; expected[b] = FRAG_BLOCK; }
+        }
+    }
+
+    fsRead(0, occupado, NUM_BLOCKS); fsRead(BLOCK_SIZE * REF_BLOCK, blockRefs, NUM_BLOCKS);
+    for(int b = 1; b < NUM_BLOCKS; b++){
+        if(occupado[b] != expected[b]){
+            printf("fsck: block %d was marked %d in the free block list, should be %d\n", b, occupado[b], expected[b]); repairs++;
+            if(expected[b] == 0) freeBlock(b); // leaked by an operation that never finished
+            else fsWrite(b, &expected[b], 1);
+        }
+        if(expected[b] == FRAG_BLOCK){
+            unsigned short mask; frags[b] |= 1; // the header slot
+            fsRead(BLOCK_SIZE * b, &mask, sizeof(mask));
+            if(mask != frags[b]){
+                printf("fsck: fixed the slot mask of fragment block %d\n", b); repairs++;
+                fsWrite(BLOCK_SIZE * b, &frags[b], sizeof(frags[b]));
+            }
+        }
+        if((blockRefs[b] > 0 || refs[b] > 1) && blockRefs[b] != refs[b]){ // indexed or shared blocks count every file pointing at them
+            printf("fsck: block %d has %d reference(s), recorded %d\n", b, refs[b], blockRefs[b]); repairs++;
+            setBlockRefs(b, refs[b]);
+        }
+    }
+    struct usage before[NUM_INODES]; memcpy(before, usage, sizeof(usage));
+    tallyUsage(0);
+    for(int i = 0; i < NUM_INODES; i++) if(MAP_TEST(inodeDirMap, i) && MAP_TEST(inodeUsedMap, i) && memcmp(&before[i], &usage[i], sizeof(usage[i])) != 0){
+        printf("fsck: fixed the usage totals of directory %d\n", i); repairs++;
+    }
+    syncChecksums();
+    printf("fsck: myfs was not closed cleanly, checked it and made %d repair(s)\n", repairs);
+}
+
+// ------------------------------ Snapshots ------------------------------ //
+/* Every block written since the last snapshot is marked in the dirty bitmap of the superblock header, and its contents from before
+ * that first write are appended to the undo log (myfs.undo). SNAPSHOT writes just those blocks, before and after, to a delta file,
+ * so the cost of a backup follows the number of blocks changed rather than the size of myfs. The superblock, inodes and reference counts
+ * travel in the delta like any other block; the checksum block does not, checksums are recomputed after every restore. */
+
+typedef struct deltaheader {
+    char magic[4];  // "MYFD"
+    int base, seq;  // the delta turns snapshot 'base' into snapshot 'seq'
+    int count;      // records that follow: block index, contents at 'base', contents at 'seq'
+} deltaheader;
+
+int openDelta(char* deltaname, deltaheader* header){
+    /*Opens a delta file and reads its header, returning the descriptor or -1 if it is missing or not a delta */
+    int fd = open(deltaname, O_RDONLY);
+    if(fd == -1 || read(fd, header, sizeof(*header)) != sizeof(*header) || memcmp(header->magic, "MYFD", 4) != 0){
+        printf("Error: '%s' is not a myfs delta file\n", deltaname);
+        if(fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void restoreDelta(int fd, int count, int after){
+    /*Writes every block of a delta back into myfs: the contents at its later snapshot if 'after' is set, at its base otherwise. Blocks are written underneath the in-memory state, see finishRestore */
+    char data[BLOCK_SIZE]; int block;
+    for(int r = 0; r < count; r++){
+        off_t record = sizeof(deltaheader) + (off_t)r * (sizeof(int) + 2 * BLOCK_SIZE);
+        pread(fd, &block, sizeof(block), record);
+        pread(fd, data, BLOCK_SIZE, record + sizeof(int) + (after ? BLOCK_SIZE : 0));
+        pwrite(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * block);
+    }
+}
+
+void finishRestore(int snapshot){
+    /*Reloads the in-memory state after blocks were restored underneath it, recomputing every checksum, and starts from 'snapshot' with no changes */
+    distrustChecksums(NULL); syncChecksums(); // any block may have been restored
+    pread(myfs, &sb, sizeof(sb), SB_HEADER); memset(inodePaged, 0, sizeof(inodePaged)); // inode state is paged in again from the restored blocks
+    memset(&names.node, 0, sizeof(names.node)); names.paged = 0; namesChanged = true; // so readers never see inodes of the pages let go
+    memset(dedupTable, 0, sizeof(dedupTable)); loadBlockRefs();
+    sb.snapshot = snapshot; sb.clean = 0; sb.freeInode = 0; writeHeader(); // the restored header's hint may not match the restored inodes
+    memset(sb.dirty, 0, sizeof(sb.dirty)); ftruncate(undoLog, 0); undoRecords = 0;
+}
+
+void SNAPSHOT(char* deltaname){ // Write every block changed since the last snapshot, before and after, into a delta file, and start a new snapshot
+    int fd = open(deltaname, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if(fd == -1){
+        printf("Error: Cannot create delta file '%s'\n", deltaname); return;
+    }
+    sb.snapshot++; writeHeader();
+    deltaheader header = {{'M', 'Y', 'F', 'D'}, sb.snapshot - 1, sb.snapshot, undoRecords};
+    write(fd, &header, sizeof(header));
+
+    char data[BLOCK_SIZE]; int block;
+    for(int r = 0; r < undoRecords; r++){ // each undo record, followed by the block as it is now
+        pread(undoLog, &block, sizeof(block), (off_t)r * UNDO_RECORD);
+        pread(undoLog, data, BLOCK_SIZE, (off_t)r * UNDO_RECORD + sizeof(int));
+        write(fd, &block, sizeof(block)); write(fd, data, BLOCK_SIZE);
+        pread(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * block);
+        write(fd, data, BLOCK_SIZE);
+    }
+    close(fd);
+    printf("Snapshot %d written to '%s': %d changed block(s)\n", sb.snapshot, deltaname, undoRecords);
+    syncChecksums(); // once the undo log is cleared, a crash no longer tells which checksums were left behind
+    memset(sb.dirty, 0, sizeof(sb.dirty)); ftruncate(undoLog, 0); undoRecords = 0;
+}
+
+void DIFF(){ // List the blocks changed since the last snapshot - what the next SNAPSHOT will write
+    printf("Blocks changed since snapshot %d:", sb.snapshot);
+    for(int b = 0; b < NUM_BLOCKS; b++) if(MAP_TEST(sb.dirty, b)) printf(" %d", b);
+    printf("\n%d block(s), a %d byte delta\n", undoRecords, (int)(sizeof(deltaheader) + undoRecords * (sizeof(int) + 2 * BLOCK_SIZE)));
+}
+
+void APPLY(char* deltaname){ // Bring myfs forward from a delta's base snapshot to the snapshot it records
+    deltaheader header; int fd = openDelta(deltaname, &header);
+    if(fd == -1) return;
+    if(sb.snapshot != header.base || undoRecords > 0){
+        printf("Error: Delta '%s' applies to an unchanged snapshot %d, myfs is at snapshot %d with %d changed block(s)\n", deltaname, header.base, sb.snapshot, undoRecords);
+        close(fd); return;
+    }
+    restoreDelta(fd, header.count, 1); close(fd);
+    finishRestore(header.seq);
+    printf("Delta '%s' applied, myfs is at snapshot %d\n", deltaname, sb.snapshot);
+}
+
+void ROLLBACK(char* deltaname){ // Discard the changes since the last snapshot, then take myfs back to the delta's base snapshot
+    deltaheader header; int fd = openDelta(deltaname, &header);
+    if(fd == -1) return;
+    if(sb.snapshot != header.seq){
+        printf("Error: Delta '%s' rolls back snapshot %d, myfs is at snapshot %d\n", deltaname, header.seq, sb.snapshot);
+        close(fd); return;
+    }
+    char data[BLOCK_SIZE]; int block;
+    for(int r = 0; r < undoRecords; r++){ // the undo log first, back to snapshot 'seq'...
+        pread(undoLog, &block, sizeof(block), (off_t)r * UNDO_RECORD);
+        pread(undoLog, data, BLOCK_SIZE, (off_t)r * UNDO_RECORD + sizeof(int));
+        pwrite(myfs, data, BLOCK_SIZE, (off_t)BLOCK_SIZE * block);
+    }
+    restoreDelta(fd, header.count, 0); close(fd); // ...then the delta, back to 'base'
+    finishRestore(header.base);
+    printf("Delta '%s' rolled back, myfs is at snapshot %d\n", deltaname, sb.snapshot);
+}
+
+// ------------------------------ Defragment ------------------------------ //
+/* DEFRAG passes over the inodes and moves every file whose blocks are out of sequence, or further from the first bucket of its
+ * directory than a free run, into one contiguous run as close to that bucket as it can, with its packed tail right behind it, and
+ * moves the bucket of a subdirectory closer to its parent's. The directory of each entry comes from the usage table, so no tree is
+ * walked. Each call looks at a few entries and remembers the inode it stopped at in the superblock header, so it can be scattered
+ * between other commands of a script. A pass that moves nothing is the last. Blocks shared by several files are left where they are. */
+
+int firstBlock(int finode){
+    /*Returns the block an entry starts at - the first bucket of a directory, the first whole block of a file - or -1 for a file without one */
+    struct inode node; int buckets[NUM_BLOCKS];
+    readInode(finode, &node);
+    if(node.dir) return dirBuckets(&node, buckets) > 0 ? buckets[0] : -1;
+    return fileBlockCount(&node) > 0 ? node.blockptrs[0] : -1;
+}
+
+int nearestFreeRun(int anchor, int count){
+    /*Returns the first block of the run of 'count' free blocks starting closest to block 'anchor', or -1 if there is none */
+    char occupado[NUM_BLOCKS]; int best = -1;
+    fsRead(0, occupado, GEO_NUM_BLOCKS);
+    for(int start = 1; start + count <= GEO_NUM_BLOCKS; start++){
+        int run = 0;
+        while(run < count && occupado[start + run] == 0) run++;
+        if(run == count && (best == -1 || abs(start - anchor) < abs(best - anchor))) best = start;
+    }
+    return best;
+}
+
+int nearestFragment(int near, int frags, int tail){
+    /*Returns the byte address of 'frags' free slots in the fragment block closest to block 'near', or -1 if there are none. A free block only counts (as an empty fragment block) when the tail at byte address 'tail' is alone in its block, so moving it there takes no extra space */
+    char occupado[NUM_BLOCKS]; unsigned short mask, own = 1 | (((1 << frags) - 1) << ((tail % GEO_BLOCK_SIZE) / GEO_FRAG_SIZE)); int best = -1;
+    fsRead(0, occupado, GEO_NUM_BLOCKS);
+    fsRead(GEO_BLOCK_SIZE * (tail / GEO_BLOCK_SIZE), &mask, sizeof(mask));
+    bool alone = mask == own;
+    for(int b = 1; b < GEO_NUM_BLOCKS; b++){
+        int addr = -1;
+        if(occupado[b] == (char)FRAG_BLOCK){
+            fsRead(GEO_BLOCK_SIZE * b, &mask, sizeof(mask));
+            for(int slot = 1, run = 0; slot < FRAGS_PER_BLOCK && addr == -1; slot++){
+                run = (mask & (1 << slot)) ? 0 : run + 1;
+                if(run == frags) addr = GEO_BLOCK_SIZE * b + GEO_FRAG_SIZE * (slot - frags + 1);
+            }
+        }
+        else if(occupado[b] == 0 && alone) addr = GEO_BLOCK_SIZE * b + GEO_FRAG_SIZE; // first slot after the header it will get
+        if(addr != -1 && (best == -1 || abs(b - near) < abs(best / GEO_BLOCK_SIZE - near))) best = addr;
+    }
+    return best;
+}
+
+void copyBlock(int from, int to){
+    /*Copies a block into a free one and marks it occupied, handing over its place in the dedup index. The original is freed by the caller once nothing points at it */
+    char data[BLOCK_SIZE], c = (char)1;
+    fsRead((off_t)GEO_BLOCK_SIZE * from, data, GEO_BLOCK_SIZE);
+    fsWrite(to, &c, 1); fsWrite((off_t)GEO_BLOCK_SIZE * to, data, GEO_BLOCK_SIZE);
+    if(blockRefs[from] == 1){
+        dedupRemove(from); setBlockRefs(from, 0); setBlockRefs(to, 1); dedupInsert(to);
+    }
+}
+
+int defragFile(int finode, int anchor){
+    /*Moves the blocks of a file into one contiguous run near 'anchor' if they are out of sequence or a free run lies closer to 'anchor' than they start, then its packed tail to the fragment block closest behind them if that is closer than its own. Returns 1 if anything was moved */
+    struct inode node; int old[8], oldTail = -1, frags = 0, moved = 0, start, i;
+    readInode(finode, &node);
+    int blockcount = fileBlockCount(&node);
+    for(i = 1; i < blockcount && node.blockptrs[i] == node.blockptrs[i - 1] + 1; i++);
+    bool scattered = i < blockcount, shared = false;
+    for(i = 0; i < blockcount; i++) shared |= blockRefs[node.blockptrs[i]] > 1; // shared blocks stay put
+    if(blockcount > 0 && !shared && (start = nearestFreeRun(anchor, blockcount)) != -1 && (scattered || abs(start - anchor) < abs(node.blockptrs[0] - anchor))){
+        for(i = 0; i < blockcount; i++){
+            old[i] = node.blockptrs[i]; copyBlock(old[i], start + i); node.blockptrs[i] = start + i;
+        }
+        moved = 1;
+    }
+    if(node.flags & INODE_TAIL){
+        int tail = node.blockptrs[blockcount], near = blockcount > 0 ? node.blockptrs[blockcount - 1] + 1 : anchor; // the tail belongs right behind the whole blocks
+        frags = tailFragments(storedSize(&node));
+        int addr = nearestFragment(near, frags, tail);
+        if(addr != -1 && abs(addr / BLOCK_SIZE - near) < abs(tail / BLOCK_SIZE - near)){
+            char data[BLOCK_SIZE];
+            fsRead(tail, data, frags * FRAG_SIZE);
+            claimFragment(addr, frags); fsWrite(addr, data, frags * FRAG_SIZE);
+            node.blockptrs[blockcount] = addr; oldTail = tail;
+        }
+    }
+    if(!moved && oldTail == -1) return 0;
+
+    writeInode(finode, &node); // the copies are in place before the old blocks are let go
+    for(i = 0; moved && i < blockcount; i++) freeBlock(old[i]);
+    if(oldTail != -1) releaseFragment(oldTail, frags);
+    return 1;
+}
+
+int defragDir(int finode, int anchor){
+    /*Moves the bucket of a single bucket directory to the free block closest to 'anchor', if that is closer than where it is. Returns 1 if it was moved */
+    struct inode node;
+    readInode(finode, &node);
+    if(node.flags & INODE_HASHED) return 0; // its buckets are spread by the hash anyway
+    int old = node.blockptrs[0], block = nearestFreeRun(anchor, 1);
+    if(block == -1 || abs(block - anchor) >= abs(old - anchor)) return 0;
+    copyBlock(old, block); node.blockptrs[0] = block;
+    writeInode(finode, &node); freeBlock(old);
+    return 1;
+}
+
+void reportFragmentation(char* when){
+    /*Prints how many steps between consecutive blocks of a file are out of sequence, and how far entries start from their directory's first bucket on average. Looks at every inode, so DEFRAG only reports when asked to */
+    int steps = 0, breaks = 0, placed = 0, distance = 0;
+    struct inode node;
+    for(int i = 1; i < NUM_INODES; i++){
+        if(!INODE_USED(i)) continue;
+        readInode(i, &node);
+        if(!node.dir) for(int b = 1; b < fileBlockCount(&node); b++, steps++) breaks += node.blockptrs[b] != node.blockptrs[b - 1] + 1;
+        int first = firstBlock(i);
+        if(first != -1){ distance += abs(first - firstBlock(usage[i].parent)); placed++; }
+    }
+    printf("Fragmentation %s: %d of %d file block steps out of sequence (%d%%), entries start %d blocks from their directory on average\n", when, breaks, steps, steps ? 100 * breaks / steps : 0, placed ? distance / placed : 0);
+}
+
+void DEFRAG(int steps, bool report){ // Look at up to 'steps' entries, moving those out of place, carrying on from the inode the last DEFRAG stopped at
+    int looked = 0, moved = 0, i = (sb.defrag > 0 && sb.defrag < NUM_INODES) ? sb.defrag : 1; // the root is never moved
+    if(report) reportFragmentation("before");
+    for(; i < NUM_INODES && looked < steps; i++){
+        if(!INODE_USED(i)) continue;
+        int anchor = firstBlock(usage[i].parent); looked++;
+        moved += INODE_DIR(i) ? defragDir(i, anchor) : defragFile(i, anchor);
+    }
+    sb.defragMoved += moved;
+    bool complete = i >= NUM_INODES && sb.defragMoved == 0; // moves may free room for entries already passed, so only a pass without any ends it
+    if(i >= NUM_INODES){ i = 1; sb.defragMoved = 0; }
+    sb.defrag = i; writeHeader();
+    if(report) reportFragmentation("after");
+    printf("Defrag moved %d entry(s), %s\n", moved, complete ? "the pass is complete" : "more to do on the next DEFRAG");
+}
+
+// ------------------------------ Opening and Running Commands ------------------------------ //
+
+int openImage(char* image, int features){
+    /*Opens an image and its undo log for the calling thread, creating the image if it does not exist yet. An image that was not closed cleanly is checked first */
+    char undo[64]; snprintf(undo, sizeof(undo), "%s.undo", image);
+    undoLog = open(undo, O_CREAT | O_RDWR, 0666); // before-images of the blocks changed since the last snapshot
+    undoRecords = lseek(undoLog, 0, SEEK_END) / UNDO_RECORD;
+    myfs = open(image, O_RDWR);
+    if(myfs == -1) myfs = init(image, features);
+    else{ // refuse images written in another on-disk format
+        char magic; read(myfs, &magic, 1);
+        if(magic != FS_MAGIC){
+            printf("Error: %s uses on-disk format '%c', this build expects '%c' - remove it to start a fresh file system\n", image, magic, FS_MAGIC); exit(1);
+        }
+        pread(myfs, &sb, sizeof(sb), SB_HEADER); // not verified yet: after a crash the superblock's checksum is out of date
+        if(!loadGeometry() || lseek(myfs, 0, SEEK_END) != (off_t)BLOCK_SIZE * NUM_BLOCKS){
+            printf("Error: %s was created with another geometry, this build expects %d blocks of %d bytes and %d inodes\n", image, NUM_BLOCKS, BLOCK_SIZE, NUM_INODES); exit(1);
+        }
+        loadChecksums();
+    }
+    if(!sb.clean){ // the last run never closed the image: only the undo log knows which blocks it changed, and their checksums are out of date
+        memset(sb.dirty, 0, sizeof(sb.dirty));
+        for(int r = 0, block; r < undoRecords; r++){
+            pread(undoLog, &block, sizeof(block), (off_t)r * UNDO_RECORD); sb.dirty[block / 8] |= 1 << (block % 8);
+        }
+        distrustChecksums(sb.dirty);
+    }
+    if(!sb.clean) FSCK(); // inode bitmaps, usage totals and names are paged in on first access, fsck pages in all of them
+    loadBlockRefs();
+    if(published == NULL) published = calloc(1, sizeof(nstable)); // a shard's table is handed in by the front end, so readers can find it
+    sb.clean = 0; writeHeader(); // until this run closes the image
+    return myfs;
+}
+
+void closeImage(){
+    /*Writes back what is left of the calling thread's image, marks it clean and closes it */
+    syncChecksums(); // bring the checksums of every block written during the run up to date
+    sb.clean = 1; writeHeader(); syncChecksums(); // marked clean only once everything else is on disk
+    close(myfs); close(undoLog);
+}
+
+void runCommand(char* command, char* line){
+    /*Executes one script command on the calling thread's image, 'line' holding its arguments */
+    if(strcmp(command, "CR") == 0){
+        char* filename = strtok(line, " ");
+        int size = atoi(strtok(NULL, " "));
+        CR(filename, size);
+    }
+    else if(strcmp(command, "DL") == 0) DL(line);
+    else if(strcmp(command, "CP") == 0){
+        char* srcname = strtok(line, " "), *dstname = strtok(NULL, " ");
+        CP(srcname, dstname);
+    }
+    else if(strcmp(command, "MV") == 0){
+        char* srcname = strtok(line, " "), *dstname = strtok(NULL, " ");
+        MV(srcname, dstname);
+    }
+    else if(strcmp(command, "CD") == 0){
+        line = strtok(line, "\n"); CD(line);
+    }
+    else if(strcmp(command, "DD") == 0) DD(line);
+    else if(strcmp(command, "LL") == 0) LL();
+    else if(strcmp(command, "SCRUB") == 0) SCRUB();
+    else if(strcmp(command, "DEDUP") == 0) DEDUP();
+    else if(strcmp(command, "SNAPSHOT") == 0) SNAPSHOT(strtok(line, " \n"));
+    else if(strcmp(command, "DIFF") == 0) DIFF();
+    else if(strcmp(command, "DEFRAG") == 0) DEFRAG((atoi(line) > 0) ? atoi(line) : DEFRAG_STEPS, strstr(line, "REPORT") != NULL); // optional number of entries to look at, and REPORT for the fragmentation before and after
+    else if(strcmp(command, "APPLY") == 0) APPLY(strtok(line, " \n"));
+    else if(strcmp(command, "ROLLBACK") == 0) ROLLBACK(strtok(line, " \n"));
+    else if(strcmp(command, "STAT") == 0) STAT(strtok(line, " \n"));
+    else if(strcmp(command, "DU") == 0) DU(strtok(line, " \n"));
+}
+
+// ------------------------------ Sharding ------------------------------ //
+/* With -s N the namespace is split over N images, ./myfs.0 to ./myfs.N-1. Every top level name belongs to one shard: the one the
+ * shard map (-m) gives it, or its FNV-1a hash modulo N. Each shard has an executor thread owning its image - all image state is per
+ * thread - and a queue of commands. The front end reads the script and queues each command on the shard owning its path, so shards
+ * run side by side. A CP or MV between shards is split in two: the source shard reads the file into a transfer and the destination
+ * shard stores it once it is ready. Commands without a path (LL, SCRUB, ...) wait for every shard to go idle and then run on each
+ * shard in turn, with delta files named after the shard. LL and STAT go to a pool of reader threads instead: a reader waits for the
+ * shard to finish the commands queued before it, then reads the shard's published namespace table while the shard keeps going. */
+
+#define MAX_SHARDS 64
+#define MAX_SHARD_MAP 64
+#define READERS 2                          // reader threads answering LL and STAT
+
+typedef struct transfer { // a file on its way from one shard to another
+    char data[8 * BLOCK_SIZE]; int size;   // contents of the file, size -1 if the source could not be read
+    char srcname[64], dstname[64];
+    int move;                              // an MV: the source is deleted once it has been read
+    sem_t ready;                           // posted by the source shard once data and size are filled in
+} transfer;
+
+typedef struct shardjob {
+    char command[16]; char* line;          // a script command and its arguments
+    transfer* xfer;                        // set for the halves of a copy between shards: sent by the source, received by the destination
+    int receive;
+    bool pagein;                           // set for a reader's request to page in what its LL (empty line) or STAT path needs
+    struct shardjob* next;
+} shardjob;
+
+typedef struct shard {
+    char image[32];                        // image file of the shard
+    int features;                          // features of the image, if it has to be created
+    pthread_t thread;
+    pthread_mutex_t lock; pthread_cond_t wake, idle;
+    shardjob* head, *tail; int pending;    // queued commands, and commands queued but not finished yet
+    int queued, completed;                 // commands ever queued and ever finished, to order reads after them
+    nstable* published;                    // the shard's namespace table, read without its lock
+} shard;
+
+typedef struct readjob {
+    char command[16]; char path[64];       // LL, or STAT and its path; an empty command stops the reader
+    int shard, ticket;                     // answered once the shard has finished 'ticket' commands
+    struct readjob* next;
+} readjob;
+
+shard shardList[MAX_SHARDS]; int shardCount;
+readjob* readHead, *readTail; pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER; pthread_cond_t readWake = PTHREAD_COND_INITIALIZER;
+struct { char name[FILENAME_MAXLEN + 1]; int shard; } shardMap[MAX_SHARD_MAP]; int shardMapSize;
+
+int shardOf(char* path){
+    /*Returns the shard owning a path, found from its top level name: the shard map's choice if it lists the name, the name's hash otherwise */
+    char top[FILENAME_MAXLEN + 1] = {0};
+    if(*path == '/') path++;
+    for(int i = 0; i < FILENAME_MAXLEN && path[i] != '\0' && path[i] != '/'; i++) top[i] = path[i];
+    for(int i = 0; i < shardMapSize; i++) if(strcmp(shardMap[i].name, top) == 0) return shardMap[i].shard; // runSharded kept only shards that exist
+    return nameHash(top) % shardCount;
+}
+
+void sendFile(transfer* xfer){
+    /*Source half of a copy between shards: reads the file into the transfer (deleting it for a move) and lets the destination shard go on. Path lookups cut the path down to its last name, so they work on copies */
+    char srcname[64]; strcpy(srcname, xfer->srcname);
+    int src_inode = findParentInode(srcname), block_og, finode_og; struct inode node;
+    xfer->size = -1;
+    if(src_inode != -1 && stalker(srcname, &block_og, &finode_og, src_inode, 0) >= 0){
+        readInode(finode_og, &node); readFileData(&node, xfer->data); xfer->size = node.size;
+    }
+    else if(src_inode != -1) printf("Error: File '%s' does not exist, or you've provided a directory - can't handle directories\n", srcname);
+    sem_post(&xfer->ready);
+    if(xfer->move && xfer->size != -1){
+        strcpy(srcname, xfer->srcname); DL(srcname);
+    }
+}
+
+void receiveFile(transfer* xfer){
+    /*Destination half of a copy between shards: waits for the source shard, then stores the file */
+    sem_wait(&xfer->ready);
+    char srcname[64], dstname[64]; strcpy(dstname, xfer->dstname);
+    strcpy(srcname, strrchr(xfer->srcname, '/') ? strrchr(xfer->srcname, '/') + 1 : xfer->srcname); // named like CP names it
+    int dst_inode = (xfer->size == -1) ? -1 : findParentInode(dstname); // nothing arrives if the source could not be read
+    if(dst_inode != -1 && copyInto(dst_inode, dstname, xfer->data, xfer->size) != -1){
+        printf("File '%s' copied successfully to destination '%s' \n", srcname, dstname);
+        if(xfer->move) printf("File '%s' moved successfully to destination '%s' \n", srcname, dstname);
     }
+    sem_destroy(&xfer->ready); free(xfer);
+}
+
+void* shardExecutor(void* arg){ // runs the commands queued on one shard against the shard's own image, until it is handed an empty command
+    shard* sh = arg;
+    published = sh->published;
+    openImage(sh->image, sh->features);
+    publishNamespace(); // nothing is paged in yet, readers ask for the pages they need (see shardReader)
+    while(1){
+        pthread_mutex_lock(&sh->lock);
+        while(sh->head == NULL) pthread_cond_wait(&sh->wake, &sh->lock);
+        shardjob* job = sh->head; sh->head = job->next;
+        if(sh->head == NULL) sh->tail = NULL;
+        pthread_mutex_unlock(&sh->lock);
+
+        bool stop = job->command[0] == '\0';
+        if(job->xfer) job->receive ? receiveFile(job->xfer) : sendFile(job->xfer);
+        else if(job->pagein) faultPath(job->line);
+        else if(!stop) runCommand(job->command, job->line);
+        free(job->line); free(job);
+        publishNamespace(); // before counting the command finished, so readers waiting on it see its changes
+
+        pthread_mutex_lock(&sh->lock);
+        sh->pending--; sh->completed++;
+        pthread_cond_broadcast(&sh->idle); // wakes the front end once the shard is idle, and readers waiting on this command
+        pthread_mutex_unlock(&sh->lock);
+        if(stop) break;
+    }
+    closeImage();
+    return NULL;
+}
+
+int appendJob(int i, shardjob* job){
+    /*Appends a job to the queue of shard i and wakes its executor. Returns the number of commands the shard has finished once this one is */
+    shard* sh = &shardList[i];
+    pthread_mutex_lock(&sh->lock);
+    if(sh->tail) sh->tail->next = job;
+    else sh->head = job;
+    sh->tail = job; sh->pending++; int ticket = ++sh->queued;
+    pthread_cond_signal(&sh->wake);
+    pthread_mutex_unlock(&sh->lock);
+    return ticket;
+}
+
+void queueJob(int i, char* command, char* line, transfer* xfer, int receive){
+    /*Appends a command to the queue of shard i. The arguments are copied */
+    shardjob* job = malloc(sizeof(shardjob));
+    strcpy(job->command, command); job->line = strdup(line); job->xfer = xfer; job->receive = receive; job->pagein = false; job->next = NULL;
+    appendJob(i, job);
 }
 
+int queuePageIn(int i, char* path){
+    /*Asks the executor of shard i to page in what a lookup of 'path' reads, all of its inodes for an empty path. Returns the ticket to wait for */
+    shardjob* job = calloc(1, sizeof(shardjob));
+    strcpy(job->command, "PAGEIN"); job->line = strdup(path); job->pagein = true;
+    return appendJob(i, job);
+}
+
+void waitShard(int i){
+    /*Waits until shard i has finished every command queued on it */
+    shard* sh = &shardList[i];
+    pthread_mutex_lock(&sh->lock);
+    while(sh->pending > 0) pthread_cond_wait(&sh->idle, &sh->lock);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void* shardReader(void* arg){ // answers LL and STAT from the shards' published namespace tables, never stopping a shard
+    while(1){
+        pthread_mutex_lock(&readLock);
+        while(readHead == NULL) pthread_cond_wait(&readWake, &readLock);
+        readjob* job = readHead; readHead = job->next;
+        if(readHead == NULL) readTail = NULL;
+        pthread_mutex_unlock(&readLock);
+        if(job->command[0] == '\0'){ free(job); break; }
+
+        shard* sh = &shardList[job->shard];
+        if(__atomic_load_n(&sh->published->paged, __ATOMIC_RELAXED) < INODE_PAGES) job->ticket = queuePageIn(job->shard, job->path); // the answer may lie in pages not loaded yet - after the commands before this one
+        pthread_mutex_lock(&sh->lock); // only to wait for the commands queued before this one, the table itself is read without it
+        while(sh->completed < job->ticket) pthread_cond_wait(&sh->idle, &sh->lock);
+        pthread_mutex_unlock(&sh->lock);
+        flockfile(stdout); // the shard header and its answer stay together
+        printf("Shard %d (%s):\n", job->shard, sh->image);
+        if(strcmp(job->command, "LL") == 0) listNamespace(sh->published);
+        else statPath(sh->published, job->path);
+        funlockfile(stdout);
+        free(job);
+    }
+    return NULL;
+}
+
+void queueRead(int i, char* command, char* path){
+    /*Hands an LL or STAT on shard i to the readers, to be answered after every command queued on the shard so far */
+    readjob* job = malloc(sizeof(readjob));
+    strcpy(job->command, command); strcpy(job->path, path); job->shard = i; job->ticket = 0; job->next = NULL;
+    if(i >= 0){
+        pthread_mutex_lock(&shardList[i].lock); job->ticket = shardList[i].queued; pthread_mutex_unlock(&shardList[i].lock);
+    }
+    pthread_mutex_lock(&readLock);
+    if(readTail) readTail->next = job;
+    else readHead = job;
+    readTail = job;
+    pthread_cond_signal(&readWake);
+    pthread_mutex_unlock(&readLock);
+}
+
+void runSharded(FILE* stream, int shards, char* mapname, int features){
+    /*Front end of the sharded mode: starts one executor per shard, routes every script command to its shard, then shuts the executors down */
+    shardCount = (shards > MAX_SHARDS) ? MAX_SHARDS : shards;
+    FILE* map = mapname ? fopen(mapname, "r") : NULL; // lines of 'name shard'
+    if(mapname && map == NULL) printf("Error: Cannot open shard map '%s', placing every name by its hash\n", mapname);
+    while(map && shardMapSize < MAX_SHARD_MAP && fscanf(map, "%8s %d", shardMap[shardMapSize].name, &shardMap[shardMapSize].shard) == 2){
+        if(shardMap[shardMapSize].shard >= 0 && shardMap[shardMapSize].shard < shardCount) shardMapSize++;
+        else printf("Error: Shard map places '%s' on shard %d, which does not exist, placing it by its hash\n", shardMap[shardMapSize].name, shardMap[shardMapSize].shard);
+    }
+    if(map) fclose(map);
+    for(int i = 0; i < shardCount; i++){
+        shard* sh = &shardList[i];
+        snprintf(sh->image, sizeof(sh->image), "./myfs.%d", i); sh->features = features;
+        pthread_mutex_init(&sh->lock, NULL); pthread_cond_init(&sh->wake, NULL); pthread_cond_init(&sh->idle, NULL);
+        sh->published = calloc(1, sizeof(nstable)); // before the executor starts, so readers never find it missing
+        pthread_create(&sh->thread, NULL, shardExecutor, sh);
+    }
+    pthread_t readers[READERS];
+    for(int i = 0; i < READERS; i++) pthread_create(&readers[i], NULL, shardReader, NULL);
+    printf("#----------------------- MYFS - %d Shards Initialized  -----------------------#\n", shardCount);
+
+    char* line = NULL, *args = NULL; char command[16]; size_t len = 0;
+    while(getline(&line, &len, stream) != -1){
+        args = realloc(args, len); args[0] = '\0';
+        if(sscanf(line, "%15s %[^\n]", command, args) < 1) continue;
+        char paths[2][64] = {{0}}; sscanf(args, "%63s %63s", paths[0], paths[1]);
+        if(strcmp(command, "CR") == 0 || strcmp(command, "DL") == 0 || strcmp(command, "CD") == 0 || strcmp(command, "DD") == 0) queueJob(shardOf(paths[0]), command, args, NULL, 0);
+        else if(strcmp(command, "DU") == 0 && strcmp(paths[0], "/") != 0) queueJob(shardOf(paths[0]), command, args, NULL, 0); // DU / is answered by every shard
+        else if(strcmp(command, "CP") == 0 || strcmp(command, "MV") == 0){
+            int from = shardOf(paths[0]), to = shardOf(paths[1]);
+            if(from == to) queueJob(from, command, args, NULL, 0);
+            else{ // the source shard sends, the destination shard receives
+                transfer* xfer = malloc(sizeof(transfer));
+                strcpy(xfer->srcname, paths[0]); strcpy(xfer->dstname, paths[1]); xfer->move = command[0] == 'M';
+                sem_init(&xfer->ready, 0, 0);
+                queueJob(from, command, "", xfer, 0); queueJob(to, command, "", xfer, 1);
+            }
+        }
+        else if(strcmp(command, "LL") == 0) for(int i = 0; i < shardCount; i++) queueRead(i, command, "");
+        else if(strcmp(command, "STAT") == 0) queueRead(shardOf(paths[0]), command, paths[0]);
+        else{ // no path: every shard runs it in turn, once all are idle
+            for(int i = 0; i < shardCount; i++) waitShard(i);
+            for(int i = 0; i < shardCount; i++){
+                char shardargs[96]; // delta files get the shard number appended
+                if(paths[0][0] != '\0' && (strcmp(command, "SNAPSHOT") == 0 || strcmp(command, "APPLY") == 0 || strcmp(command, "ROLLBACK") == 0)) snprintf(shardargs, sizeof(shardargs), "%s.%d", paths[0], i);
+                else snprintf(shardargs, sizeof(shardargs), "%s", args);
+                printf("Shard %d (%s):\n", i, shardList[i].image);
+                queueJob(i, command, shardargs, NULL, 0); waitShard(i);
+            }
+        }
+    }
+    for(int i = 0; i < READERS; i++) queueRead(-1, "", ""); // readers go first: they may still be waiting on the shards
+    for(int i = 0; i < READERS; i++) pthread_join(readers[i], NULL);
+    for(int i = 0; i < shardCount; i++) queueJob(i, "", "", NULL, 0); // an empty command stops the executor
+    for(int i = 0; i < shardCount; i++) pthread_join(shardList[i].thread, NULL);
+    for(int i = 0; i < shardCount; i++) free(shardList[i].published);
+    free(line); free(args);
+}
+
+// ------------------------------- Name Search Benchmark ------------------------------ //
+#ifdef BENCH_NAMESCAN
+int main(){ // times each name search kernel on a full directory block, looking up every entry in turn (make bench)
+    struct dirblock block; memset(&block, 0, sizeof(block));
+    for(int i = 0; i < DIRENTS_PER_BLOCK; i++) snprintf(block.name[i], FILENAME_MAXLEN, "f%d", i);
+    struct { char* label; int (*kernel)(char (*)[FILENAME_MAXLEN], int, int, uint64_t); } kernels[] = {
+        {"scalar", scanNamesScalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", scanNamesSSE2}, {"avx2", __builtin_cpu_supports("avx2") ? scanNamesAVX2 : NULL},
+#endif
+    };
+    for(int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++){
+        if(kernels[k].kernel == NULL) continue;
+        long rounds = 200000, found = 0;
+        struct timespec t0, t1; clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(long r = 0; r < rounds; r++){
+            uint64_t key; memcpy(&key, block.name[r % DIRENTS_PER_BLOCK], sizeof(key));
+            found += kernels[k].kernel(block.name, 0, DIRENTS_PER_BLOCK, key);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / rounds;
+        printf("%-6s %6.1f ns/lookup (checksum %ld)\n", kernels[k].label, ns, found);
+    }
+    return 0;
+}
+#elif defined(BENCH_GEOMETRY)
+int main(){ // times the allocation, directory scan and block copy paths on a fresh image, for comparing specialized and generic builds (make geobench)
+    selectChecksum(); selectNameScan();
+    unlink("./geobench.img"); unlink("./geobench.img.undo");
+    openImage("./geobench.img", 0);
+    struct inode root; struct dirblock bucket; readInode(0, &root);
+    fsRead((off_t)GEO_BLOCK_SIZE * ROOT_BLOCK, &bucket, sizeof(bucket));
+    for(bucket.count = 1; bucket.count < GEO_DIRENTS; bucket.count++){ // fill the root's bucket with names, the inodes they point at are never read
+        char name[16]; snprintf(name, sizeof(name), "f%d", bucket.count); copyName(bucket.name[bucket.count], name); bucket.hash[bucket.count] = nameHash(bucket.name[bucket.count]); bucket.inode[bucket.count] = 1;
+    }
+    fsWrite((off_t)GEO_BLOCK_SIZE * ROOT_BLOCK, &bucket, sizeof(bucket));
+    int from = allocateBlock(), rounds = 20000; long check = 0; double ns[3];
+    for(int k = 0; k < 3; k++){
+        struct timespec t0, t1; clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int r = 0; r < rounds; r++){
+            if(k == 0){ int block = allocateBlock(); check += block; freeBlock(block); }
+            else if(k == 1){ char name[FILENAME_MAXLEN + 1]; int node; snprintf(name, sizeof(name), "f%d", 1 + r % (GEO_DIRENTS - 1)); check += findDirEntry(&root, name, -1, &node); }
+            else{ int to = from + 1 + r % 8; copyBlock(from, to); freeBlock(to); }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[k] = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / rounds;
+    }
+    printf("%s %d x %d B, %d inodes: allocate %.1f ns, directory scan %.1f ns, block copy %.1f ns (checksum %ld)\n",
+#ifdef GEOMETRY_RUNTIME
+        "generic    ",
+#else
+        "specialized",
+#endif
+        GEO_NUM_BLOCKS, GEO_BLOCK_SIZE, GEO_NUM_INODES, ns[0], ns[1], ns[2], check);
+    closeImage(); unlink("./geobench.img"); unlink("./geobench.img.undo");
+    return 0;
+}
+#else
 // ------------------------------- Main Function ------------------------------ //
 int main(int argc, char* argv[]){
     printf("#----------------------- Initializing MYFS - File System -----------------------#\n");
-    myfs = open("./myfs", O_RDWR);
-    if(myfs == -1) myfs = init();
-    // sleep(1); printf("Loading----------25%%\n"); sleep(1); printf("Loading------------------50%%\n"); sleep(1); printf("Loading--------------------------75%%\n"); sleep(1); printf("Loading----------------------------------100%%\n"); sleep(1); //Uncomment this line for kewl kewl loading effect
-    printf("#----------------------- MYFS - File System Initialized  -----------------------#\n"); 
-    // sleep(1);
-    FILE *stream = fopen(argv[1], "r"); // open the input file stream -> 'r' for read mode
+    selectChecksum(); selectNameScan();
+    int features = 0, shards = 0; char* mapname = NULL;
+    // 'myfs.out [-c] [-d] [-s shards [-m shardmap]] script': -c and -d create new images with compression and/or inline deduplication enabled, -s splits the namespace over several images
+    for(; argc > 2 && argv[1][0] == '-'; argc--, argv++){
+        if(strcmp(argv[1], "-c") == 0) features |= FEATURE_COMPRESS;
+        else if(strcmp(argv[1], "-d") == 0) features |= FEATURE_DEDUP;
+        else if(strcmp(argv[1], "-s") == 0 && argc > 3){ shards = atoi(argv[2]); argc--; argv++; }
+        else if(strcmp(argv[1], "-m") == 0 && argc > 3){ mapname = argv[2]; argc--; argv++; }
+    }
+    FILE *stream;
+    if(shards > 0){ // sharded: the front end routes each command to the executor of the shard owning its path
+        if((stream = fopen(argv[1], "r")) == NULL){
+            printf("Error opening file\n"); exit(1);
+        }
+        runSharded(stream, shards, mapname, features);
+        fclose(stream);
+        printf("#----------------------- MYFS - File System Closed -----------------------#\n");
+        return 0;
+    }
+    stream = fopen(argv[1], "r"); // open the input file stream -> 'r' for read mode, before myfs so a bad path never leaves it open
     if(stream == NULL){ // if the file doesn't exist, print error and exit
         printf("Error opening file\n"); exit(1);
     }
+    openImage("./myfs", features);
+    // sleep(1); printf("Loading----------25%%\n"); sleep(1); printf("Loading------------------50%%\n"); sleep(1); printf("Loading--------------------------75%%\n"); sleep(1); printf("Loading----------------------------------100%%\n"); sleep(1); //Uncomment this line for kewl kewl loading effect
+    printf("#----------------------- MYFS - File System Initialized  -----------------------#\n"); 
+    // sleep(1);
     // line is the buffer to store the input line, command is the buffer to store the commands and args to be executed, len is the length of the line
-    char* line = NULL; char command[3]; size_t len = 0;
+    char* line = NULL; char command[16]; size_t len = 0;
 
     while(getline(&line, &len, stream) != - 1){ // read the input file line by line until EOF reached
-        sscanf(line, "%s %[^\n]", command, line); // split the line into command and args and check which command it is, then execute the corresponding function
-        if(strcmp(command, "CR") == 0){
-            char* filename = strtok(line, " ");
-            int size = atoi(strtok(NULL, " "));
-            CR(filename, size);
-        }
-        else if(strcmp(command, "DL") == 0) DL(line);
-        else if(strcmp(command, "CP") == 0){
-            char* srcname = strtok(line, " "), *dstname = strtok(NULL, " ");
-            CP(srcname, dstname);
-        }
-        else if(strcmp(command, "MV") == 0){
-            char* srcname = strtok(line, " "), *dstname = strtok(NULL, " ");
-            MV(srcname, dstname);
-        }
-        else if(strcmp(command, "CD") == 0){
-            line = strtok(line, "\n"); CD(line);
-        }
-        else if(strcmp(command, "DD") == 0) DD(line);
-        else if(strcmp(command, "LL") == 0) LL();
+        sscanf(line, "%15s %[^\n]", command, line); // split the line into command and args, then execute the corresponding function
+        runCommand(command, line); publishNamespace();
     }
-    free(line); fclose(stream); close(myfs); // free the line buffer, close the input file stream and close the file system
+    closeImage();
+    free(line); fclose(stream); // free the line buffer and close the input file stream
     printf("#----------------------- MYFS - File System Closed -----------------------#\n");
 	return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file